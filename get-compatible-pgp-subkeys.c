@@ -1,214 +1,7618 @@
 // Copyright (C) 2024 Elliot Killick <contact@elliotkillick.com>
 // Licensed under the MIT License. See LICENSE file for details.
 
+// For statx (io_uring backend)
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
 #include <arpa/inet.h>
-// For GNOME library base64 decoder
-// This base64 library was chosen because it's written in C (not C++), LGPL, has clean and relatively simple code, is well-tested, supports in-place decoding, and performs very well in performance tests
-// There are other base64 libraries that support SSE/AVX decoding but that's only faster if you're decoding long base64 strings. This isn't the case for us because we're only decoding a few bytes at a time
-#include <glib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#ifdef DT_UNKNOWN
+#define DIRENT_TYPE(dirent) ((dirent)->d_type)
+#else
+// No d_type on this platform so every entry takes a stat
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+#define DIRENT_TYPE(dirent) DT_UNKNOWN
+#endif
+
+#ifdef __linux__
+// For getdents64 (and io_uring) which we call directly
+#include <sys/syscall.h>
+// For moving keys across file systems
+#include <sys/sendfile.h>
+// For watch mode
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
+#include "pgpts.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// How much of a key file we read up front
+// This covers the armor header line, the usual "Comment:"/"Version:" headers and the first line of base64
+#define PGP_KEY_HEADER_SIZE 512
+// How far into a file we keep looking for the first line of base64 (only reached for unusually long armor headers)
+#define PGP_KEY_HEADER_MAX_SIZE 65536
+
+// Number of directory entries each worker thread may have in flight (queued, being processed or waiting to be printed)
+// The reorder window is this times the number of workers
+#define SCAN_ENTRIES_PER_WORKER 128
+// Directory entries are handed from the enumerator to the workers in batches of this many
+#define SCAN_BATCH_SIZE 32
+// Files per io_uring submission
+// Each file takes 3 SQEs (openat -> read -> close, plus a statx first if d_type doesn't say it's a regular file)
+// so a batch is one io_uring_enter call, plus one more if any keys need moving
+#define SCAN_URING_BATCH_SIZE 4096
+// Default --prefetch depth (entries warmed ahead of the workers, see "Prefetching")
+#define SCAN_PREFETCH_DEPTH 256
+#define SCAN_PREFETCH_MAX_DEPTH 65536
+// Buffer for each getdents64 call (enough for roughly 100k VanityGPG file names)
+#define SCAN_GETDENTS_BUFFER_SIZE (4 * 1024 * 1024)
+// Smallest one --max-mem shrinks it to
+#define SCAN_GETDENTS_MIN_BUFFER_SIZE (64 * 1024)
+// Smallest possible record: header + 1 character name + null byte, rounded up to 8 bytes
+#define SCAN_GETDENTS_MIN_RECLEN 24
+
+// Instrumentation (build with make STATS=1)
+//
+// Each thread counts and times the stages it runs in a block of its own, so the hot path never takes a lock or
+// shares a cache line with another thread. The blocks are merged when the summary is printed (at exit and on
+// SIGUSR1). Times are nanoseconds from clock_gettime (a vDSO call, not a syscall) kept in power of two buckets
+// Without STATS the macros compile to nothing
+
+#ifdef SCAN_STATS
+enum scan_stats_stage {
+    SCAN_STAGE_READDIR,
+    SCAN_STAGE_STAT,
+    SCAN_STAGE_OPEN,
+    SCAN_STAGE_READ,
+    SCAN_STAGE_CLOSE,
+    SCAN_STAGE_PARSE_RAW,
+    SCAN_STAGE_PARSE_ARMOR,
+    // One submit + wait of a whole batch (the statx/openat/read/close/renameat in it aren't timed separately)
+    SCAN_STAGE_URING,
+    SCAN_STAGE_RENAME,
+    SCAN_STAGE_OUTPUT,
+    // Warming one file in the prefetch thread (stat, open, fadvise and close)
+    SCAN_STAGE_PREFETCH,
+    SCAN_STAGES
+};
+
+const char* const scan_stats_stage_names[SCAN_STAGES] = {
+    "readdir", "stat", "open", "read", "close", "parse raw", "parse armor", "io_uring", "rename", "output", "prefetch"
+};
+
+enum scan_stats_counter {
+    SCAN_COUNTER_ENTRIES,
+    SCAN_COUNTER_SKIPPED,
+    SCAN_COUNTER_STAT_FAILED,
+    SCAN_COUNTER_FAILED,
+    SCAN_COUNTER_EXTRACTED,
+    SCAN_COUNTER_INDEXED,
+    SCAN_COUNTER_MATCHED,
+    SCAN_COUNTER_MOVE_FAILED,
+    SCAN_COUNTERS
+};
+
+const char* const scan_stats_counter_names[SCAN_COUNTERS] = {
+    "entries", "skipped", "stat failed", "failed", "extracted", "indexed", "matched", "move failed"
+};
+
+// Bucket b holds times in [2^b, 2^(b+1)) ns, the last one everything slower
+#define SCAN_STATS_BUCKETS 40
+
+struct scan_stats {
+    uint64_t calls[SCAN_STAGES];
+    uint64_t ns[SCAN_STAGES];
+    uint64_t histogram[SCAN_STAGES][SCAN_STATS_BUCKETS];
+    uint64_t counters[SCAN_COUNTERS];
+    unsigned int thread;
+    struct scan_stats* next;
+};
+
+// Every thread's block (never freed so a summary can still include threads that have exited)
+struct scan_stats* scan_stats_threads;
+unsigned int scan_stats_threads_count;
+pthread_mutex_t scan_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local struct scan_stats* scan_stats_self;
+
+struct scan_stats* scan_stats_get(void)
+{
+    struct scan_stats* stats = scan_stats_self;
+    struct scan_stats** tail;
+
+    if (stats != NULL)
+        return stats;
+
+    // Without a block there's nowhere to count so the stats are just left out
+    stats = calloc(1, sizeof(*stats));
+    if (stats == NULL) {
+        static struct scan_stats discard;
+        return &discard;
+    }
+
+    pthread_mutex_lock(&scan_stats_lock);
+    stats->thread = scan_stats_threads_count++;
+    for (tail = &scan_stats_threads; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = stats;
+    pthread_mutex_unlock(&scan_stats_lock);
+
+    scan_stats_self = stats;
+    return stats;
+}
+
+// Only the owning thread writes a block but the summary may read it at any time
+static inline void scan_stats_add(uint64_t* counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t scan_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void scan_stats_stage_done(int stage, uint64_t start)
+{
+    struct scan_stats* stats = scan_stats_get();
+    uint64_t ns = scan_stats_now() - start;
+    int bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= SCAN_STATS_BUCKETS)
+        bucket = SCAN_STATS_BUCKETS - 1;
+
+    scan_stats_add(&stats->calls[stage], 1);
+    scan_stats_add(&stats->ns[stage], ns);
+    scan_stats_add(&stats->histogram[stage][bucket], 1);
+}
+
+void scan_stats_count(int counter)
+{
+    scan_stats_add(&scan_stats_get()->counters[counter], 1);
+}
+
+// Upper bound of the bucket the given fraction of calls falls in
+uint64_t scan_stats_percentile(const uint64_t* histogram, uint64_t calls, double fraction)
+{
+    uint64_t seen = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < SCAN_STATS_BUCKETS - 1; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= calls * fraction)
+            break;
+    }
+
+    return (uint64_t)2 << bucket;
+}
+
+void scan_stats_print(void)
+{
+    struct scan_stats merged = { 0 };
+    struct scan_stats* stats;
+    int stage;
+    int bucket;
+    int i;
+
+    pthread_mutex_lock(&scan_stats_lock);
+
+    fprintf(stderr, "Statistics (%u threads):\n", scan_stats_threads_count);
+    for (stats = scan_stats_threads; stats != NULL; stats = stats->next) {
+        uint64_t busy = 0;
+
+        for (stage = 0; stage < SCAN_STAGES; stage++) {
+            merged.calls[stage] += __atomic_load_n(&stats->calls[stage], __ATOMIC_RELAXED);
+            merged.ns[stage] += __atomic_load_n(&stats->ns[stage], __ATOMIC_RELAXED);
+            busy += __atomic_load_n(&stats->ns[stage], __ATOMIC_RELAXED);
+            for (bucket = 0; bucket < SCAN_STATS_BUCKETS; bucket++)
+                merged.histogram[stage][bucket] += __atomic_load_n(&stats->histogram[stage][bucket], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < SCAN_COUNTERS; i++)
+            merged.counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+
+        fprintf(stderr, "  thread %u: %.3f ms in timed stages\n", stats->thread, busy / 1e6);
+    }
+
+    pthread_mutex_unlock(&scan_stats_lock);
+
+    for (i = 0; i < SCAN_COUNTERS; i++)
+        fprintf(stderr, "  %-12s %12llu\n", scan_stats_counter_names[i], (unsigned long long)merged.counters[i]);
+
+    fprintf(stderr, "  %-12s %12s %12s %10s %10s %10s %10s\n", "stage", "calls", "total ms", "avg ns", "p50 ns", "p90 ns", "p99 ns");
+    for (stage = 0; stage < SCAN_STAGES; stage++) {
+        uint64_t calls = merged.calls[stage];
+
+        if (calls == 0)
+            continue;
+        fprintf(stderr, "  %-12s %12llu %12.3f %10llu %10llu %10llu %10llu\n", scan_stats_stage_names[stage],
+                (unsigned long long)calls, merged.ns[stage] / 1e6, (unsigned long long)(merged.ns[stage] / calls),
+                (unsigned long long)scan_stats_percentile(merged.histogram[stage], calls, 0.5),
+                (unsigned long long)scan_stats_percentile(merged.histogram[stage], calls, 0.9),
+                (unsigned long long)scan_stats_percentile(merged.histogram[stage], calls, 0.99));
+    }
+
+    // Histograms: the number of calls taking less than each power of two ns
+    for (stage = 0; stage < SCAN_STAGES; stage++) {
+        if (merged.calls[stage] == 0)
+            continue;
+        fprintf(stderr, "  %s:", scan_stats_stage_names[stage]);
+        for (bucket = 0; bucket < SCAN_STATS_BUCKETS; bucket++) {
+            if (merged.histogram[stage][bucket] != 0)
+                fprintf(stderr, " <%llu:%llu", (unsigned long long)2 << bucket, (unsigned long long)merged.histogram[stage][bucket]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void* scan_stats_signal_main(void* arg)
+{
+    sigset_t* set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+        scan_stats_print();
+
+    return NULL;
+}
+
+// Prints the summary on SIGUSR1 (from a thread of its own so it's not limited to async-signal-safe calls) and at exit
+// Must be called before any other thread is started so they all inherit SIGUSR1 being blocked
+void scan_stats_start(void)
+{
+    static sigset_t set;
+    sigset_t all;
+    sigset_t old;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    // The thread blocks everything else so it never takes a signal meant for the rest of the program (e.g. the
+    // SIGINT that ends watch mode)
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, scan_stats_signal_main, &set) == 0)
+        pthread_detach(thread);
+    sigaddset(&old, SIGUSR1);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    atexit(scan_stats_print);
+}
+
+#define SCAN_STATS_TIME(start) uint64_t start = scan_stats_now()
+#define SCAN_STATS_STAGE(stage, start) scan_stats_stage_done(stage, start)
+#else
+#define SCAN_STATS_TIME(start)
+#define SCAN_STATS_STAGE(stage, start)
+#endif
+
+// The parser's statuses (see pgpts.h) plus the one that only reading a key file can have
+enum pgp_key_status {
+    PGP_KEY_OK = PGP_TS_OK,
+    PGP_KEY_ERR_OPEN = 1,
+    PGP_KEY_ERR_EMPTY = PGP_TS_ERR_EMPTY,
+    PGP_KEY_ERR_READ = PGP_TS_ERR_SHORT,
+    PGP_KEY_ERR_RAW = PGP_TS_ERR_RAW,
+    PGP_KEY_ERR_ARMOR = PGP_TS_ERR_ARMOR,
+    PGP_KEY_ERR_PACKET = PGP_TS_ERR_PACKET
+};
+
+const char* pgp_key_strerror(int status)
+{
+    switch (status) {
+    case PGP_KEY_ERR_OPEN:
+        return "Failed to open PGP key";
+    case PGP_KEY_ERR_EMPTY:
+        return "PGP key is empty";
+    case PGP_KEY_ERR_READ:
+        return "Failed to read PGP key";
+    case PGP_KEY_ERR_RAW:
+        return "Failed to extract timestamp from raw PGP key";
+    case PGP_KEY_ERR_ARMOR:
+        return "Failed to dearmor and extract timestamp from PGP key";
+    case PGP_KEY_ERR_PACKET:
+        return "Not an OpenPGP v4 key packet";
+    }
+
+    return "Unknown error";
+}
+
+// Which tool wrote the keys (--format), set before any thread starts
+// Armored keys laid out the way it writes them are parsed at fixed offsets (see pgp_ts_extract_format)
+int pgp_key_format = PGP_TS_FORMAT_AUTO;
+
+// Extract the creation timestamp from the start of a PGP key file that has already been read into memory
+// Returns PGP_KEY_OK on success or one of the other pgp_key_status values (see pgp_key_strerror) on failure
+// The parsing is done by libpgpts (see pgpts.h), only the stats are kept here
+int pgp_key_extract_timestamp_buf(const unsigned char* buf, size_t len, unsigned int* out_timestamp)
+{
+    uint32_t timestamp;
+    SCAN_STATS_TIME(start);
+    int ret = pgp_ts_extract_format(buf, len, pgp_key_format, &timestamp);
+
+#ifdef SCAN_STATS
+    if (len >= 5)
+        SCAN_STATS_STAGE(memcmp(buf, "-----", 5) == 0 ? SCAN_STAGE_PARSE_ARMOR : SCAN_STAGE_PARSE_RAW, start);
+#endif
+    if (ret == PGP_KEY_OK)
+        *out_timestamp = timestamp;
+    return ret;
+}
+
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+
+// Cleared the first time the kernel refuses O_NOATIME (it's only allowed on files we own) so we don't keep asking
+atomic_int pgp_key_open_noatime = 1;
+
+// O_NOATIME saves an inode update (and with it a metadata write back to disk) for every key we read
+int pgp_key_open(int dirfd, const char* name)
+{
+    int fd;
+
+    if (atomic_load_explicit(&pgp_key_open_noatime, memory_order_relaxed)) {
+        fd = openat(dirfd, name, O_RDONLY | O_NOATIME | O_CLOEXEC);
+        if (fd != -1 || errno != EPERM)
+            return fd;
+        atomic_store_explicit(&pgp_key_open_noatime, 0, memory_order_relaxed);
+    }
+
+    return openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+}
+
+// Opens name relative to dirfd (AT_FDCWD for a plain path) and reads the start of the key with a single pread
+// There's no stdio here so no per-file buffer allocation, no fseek and no fgets, just open + pread + close
+// buf must have room for PGP_KEY_HEADER_MAX_SIZE bytes (it's meant to be reused for every key a thread reads)
+// Nothing is printed here so the caller decides how (and in what order) to report errors
+int pgp_key_extract_timestamp(int dirfd, const char* name, unsigned char* buf, unsigned int* out_timestamp) {
+    int fd;
+    ssize_t len;
+    ssize_t more;
+    int ret;
+    SCAN_STATS_TIME(start);
+
+    fd = pgp_key_open(dirfd, name);
+    SCAN_STATS_STAGE(SCAN_STAGE_OPEN, start);
+    if (fd == -1)
+        return PGP_KEY_ERR_OPEN;
+
+    SCAN_STATS_TIME(read_start);
+    len = pread(fd, buf, PGP_KEY_HEADER_SIZE, 0);
+    SCAN_STATS_STAGE(SCAN_STAGE_READ, read_start);
+    if (len == -1) {
+        close(fd);
+        return PGP_KEY_ERR_READ;
+    }
+
+    ret = pgp_key_extract_timestamp_buf(buf, len, out_timestamp);
+
+    // Armor headers pushed the first line of base64 past what we read so keep going
+    if (ret == PGP_KEY_ERR_ARMOR && len == PGP_KEY_HEADER_SIZE) {
+        more = pread(fd, buf + len, PGP_KEY_HEADER_MAX_SIZE - len, len);
+        if (more > 0)
+            ret = pgp_key_extract_timestamp_buf(buf, len + more, out_timestamp);
+    }
+
+    SCAN_STATS_TIME(close_start);
+    close(fd);
+    SCAN_STATS_STAGE(SCAN_STAGE_CLOSE, close_start);
+    return ret;
+}
+
+enum scan_io {
+    // io_uring if the kernel supports it, otherwise sync
+    SCAN_IO_AUTO,
+    SCAN_IO_SYNC,
+    SCAN_IO_URING
+};
+
+// What's done with compatible keys
+enum scan_action {
+    SCAN_ACTION_MOVE,
+    // Hard link into the destination (the key stays in the source directory)
+    SCAN_ACTION_LINK,
+    // Symlink in the destination pointing at the key
+    SCAN_ACTION_SYMLINK,
+    // Copy out of a pack (see "Keypacks")
+    SCAN_ACTION_EXTRACT,
+    // Only report them (no destination directory or --dry-run)
+    SCAN_ACTION_NONE
+};
+
+// entry->move_status (-1 if no action was attempted), for links as well as moves
+enum scan_move_status {
+    SCAN_MOVE_DONE = 0,
+    SCAN_MOVE_FAILED,
+    // A file of the same name is already in the destination
+    SCAN_MOVE_EXISTS,
+    // Only returned by scan_move_rename: the destination is on another file system
+    SCAN_MOVE_CROSS_DEVICE
+};
+
+// Primary keys per scan (--primary can be repeated)
+#define SCAN_FILTER_MAX_ROUTES 64
+
+// A primary key and where the keys compatible with it go
+struct scan_route {
+    // Key file or timestamp as given, then its timestamp
+    const char* key;
+    unsigned int timestamp;
+    // NULL (and -1) to only report the keys
+    const char* dest_dir;
+    int dest_fd;
+    // Position on the command line (ties between equal timestamps go to the last one given)
+    unsigned int order;
+};
+
+// Every predicate on a key's timestamp, compiled down to one range check and a binary search (see scan_filter_route)
+struct scan_filter {
+    // Inclusive bounds (from --min and --max) already narrowed to the earliest primary key
+    unsigned int min;
+    unsigned int max;
+    // Sorted by timestamp
+    struct scan_route routes[SCAN_FILTER_MAX_ROUTES];
+    size_t count;
+};
+
+struct scan_index;
+struct scan_select;
+struct scan_pack;
+
+// Settings shared by every stage of the scan (read-only once the scan starts)
+struct scan_config {
+    char* source_dir;
+    char* dest_dir;
+    int source_dirfd;
+    // -1 unless there's an action to carry out
+    int dest_dirfd;
+    // A primary key (or --min/--max) was given so compatible keys are picked out
+    int match;
+    struct scan_filter filter;
+    int action;
+    // Absolute path of the source directory (only for SCAN_ACTION_SYMLINK)
+    char* source_realpath;
+    // Compatible keys (every key if there's nothing to match) are listed in this file (-1 if not wanted), with their
+    // timestamps if manifest_timestamps is set or as binary records (see "Manifests") if manifest_binary is
+    int manifest_fd;
+    int manifest_timestamps;
+    int manifest_binary;
+    // Only keys whose path hashes to shard_index of shard_count are processed (shard_count 0 = no sharding)
+    unsigned int shard_index;
+    unsigned int shard_count;
+    // Query mode only
+    unsigned int timestamp_query;
+    unsigned int jobs;
+    int ordered;
+    int io;
+    size_t batch_size;
+    // Size of the getdents64 buffer
+    size_t dir_buffer_size;
+    // Entries the prefetch stage warms ahead of the workers (0 = no prefetch stage)
+    size_t prefetch;
+    int inode_order;
+    // Timestamp index from previous runs (NULL if not enabled)
+    struct scan_index* index;
+    // --checkpoint (NULL if not enabled)
+    struct scan_checkpoint* checkpoint;
+    // -j auto (NULL if not enabled)
+    struct scan_tune* tune;
+    // --first or --closest (NULL if neither was given)
+    struct scan_select* select;
+    // Keys come from this pack instead of the source directory (NULL if not --pack)
+    struct scan_pack* pack;
+    // Process keys as they're written to the source directory instead of reading it
+    int watch;
+    // Walk subdirectories too (the destination gets the same layout)
+    int recursive;
+    // The destination directory, which the walk mustn't go into when it's inside the source
+    dev_t dest_dev;
+    ino_t dest_ino;
+    int output_format;
+    // Only report errors
+    int quiet;
+    // Print a rate counter every second
+    int progress;
+};
+
+// The route of a key with the given timestamp, -1 if it's out of range (so not compatible with any primary key)
+// A key compatible with several primary keys goes to the latest of them as it has the fewest candidates
+static inline int scan_filter_route(const struct scan_filter* filter, unsigned int timestamp)
+{
+    size_t low = 0;
+    size_t high = filter->count;
+
+    // One unsigned compare for both bounds
+    if (timestamp - filter->min > filter->max - filter->min)
+        return -1;
+
+    // The last route at or before the timestamp (there is one as min is at least the first route's timestamp)
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (filter->routes[mid].timestamp <= timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return (int)low - 1;
+}
+
+enum scan_status {
+    // Directory, empty file or hidden file (nothing is printed for these)
+    SCAN_SKIPPED,
+    SCAN_STAT_FAILED,
+    // extract_status holds the return value of pgp_key_extract_timestamp
+    SCAN_EXTRACTED,
+    // Stat'ed but not found in the index so still has to be read (never reported)
+    SCAN_PENDING
+};
+
+// A subdirectory's destination is only created when the first key is moved into it (see scan_tree_dest_fd)
+#define SCAN_DIR_DEST_UNOPENED -2
+#define SCAN_DIR_DEST_FAILED -3
+
+// A directory of a recursive scan (see scan_enumerate_tree)
+struct scan_dir {
+    int fd;
+    // Where compatible keys from this directory go (-1 if not moving, or one of the SCAN_DIR_DEST_* states)
+    atomic_int dest_fd;
+    // Path relative to the source directory with a trailing slash ("" for the source directory itself)
+    char* prefix;
+    // Sequence number after the last entry in this directory
+    size_t end_seq;
+    // fd is ours to close (everything but the source directory)
+    int owned;
+};
+
+// One directory entry and the outcome of running it through the open/extract/compare/move pipeline
+// The pipeline only records what happened so printing can be deferred (e.g. to restore directory entry order)
+struct scan_entry {
+    const char* name;
+    // Directory the name is relative to (NULL for the source directory itself outside of a recursive scan)
+    const struct scan_dir* dir;
+    // DT_* file type from the directory entry (DT_UNKNOWN if the file system or platform doesn't provide one)
+    unsigned char d_type;
+    // From the directory entry, replaced by the stat result when there is one
+    ino_t ino;
+    // Only filled in when the file was stat'ed (or it's in a pack)
+    uint64_t size;
+    // The key in a pack (size bytes of it), NULL for a file
+    const unsigned char* data;
+    int64_t mtime_ns;
+    int status;
+    int extract_status;
+    unsigned int timestamp;
+    // Timestamp came from the index rather than the file
+    int indexed;
+    // -1 = no action attempted, otherwise a scan_move_status (whatever the action was)
+    int move_status;
+    // Compatible but left alone for --first or --closest (see scan_select_entry)
+    int passed_over;
+};
+
+// Memory
+//
+// The scan allocates everything it keeps up front, and from then on only recycles it. Each worker has one arena
+// with its key buffer, pending copies, output buffers, queue, io_uring buffers and --closest candidates. The pool
+// has one with the shared output and the directory buffer. Entries live in the fixed ring of slots (see Parallel
+// scan), so nothing is allocated per file and memory stays flat however many entries there are. What does grow
+// with the tree is the new timestamp index (--index) and the -r queue of directories still to walk, whose paths
+// are kept in a string slab rather than allocated one by one
+// Every allocation is counted against the --max-mem budget (0 = none): the fixed part is shrunk to fit first (see
+// scan_mem_plan) and an allocation that would go over it fails as if malloc had run out of memory
+// The peak is reported at the end with --progress or --max-mem
+
+// In front of each allocation (keeps the alignment malloc gives)
+#define SCAN_MEM_HEADER 16
+#define SCAN_ARENA_ALIGN 64
+
+struct scan_mem {
+    size_t budget;
+    atomic_size_t used;
+    atomic_size_t peak;
+    atomic_size_t allocations;
+};
+
+struct scan_mem scan_mem;
+
+void* scan_mem_alloc_zeroed(size_t size, int zero)
+{
+    size_t total = size + SCAN_MEM_HEADER;
+    size_t used;
+    size_t peak;
+    char* p;
+
+    if (size > SIZE_MAX - SCAN_MEM_HEADER)
+        return NULL;
+    used = atomic_fetch_add(&scan_mem.used, total) + total;
+    if (scan_mem.budget != 0 && used > scan_mem.budget) {
+        atomic_fetch_sub(&scan_mem.used, total);
+        return NULL;
+    }
+    if ((p = zero ? calloc(1, total) : malloc(total)) == NULL) {
+        atomic_fetch_sub(&scan_mem.used, total);
+        return NULL;
+    }
+
+    peak = atomic_load(&scan_mem.peak);
+    while (used > peak && !atomic_compare_exchange_weak(&scan_mem.peak, &peak, used))
+        ;
+    atomic_fetch_add(&scan_mem.allocations, 1);
+    memcpy(p, &size, sizeof(size));
+    return p + SCAN_MEM_HEADER;
+}
+
+void* scan_mem_alloc(size_t size)
+{
+    return scan_mem_alloc_zeroed(size, 0);
+}
+
+void* scan_mem_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+        return NULL;
+    return scan_mem_alloc_zeroed(count * size, 1);
+}
+
+void scan_mem_free(void* p)
+{
+    size_t size;
+
+    if (p == NULL)
+        return;
+    memcpy(&size, (char*)p - SCAN_MEM_HEADER, sizeof(size));
+    atomic_fetch_sub(&scan_mem.used, size + SCAN_MEM_HEADER);
+    free((char*)p - SCAN_MEM_HEADER);
+}
+
+// Like realloc, p is left alone if this fails
+void* scan_mem_realloc(void* p, size_t size)
+{
+    size_t old_size = 0;
+    char* q;
+
+    if (p != NULL)
+        memcpy(&old_size, (char*)p - SCAN_MEM_HEADER, sizeof(old_size));
+    if ((q = scan_mem_alloc(size)) == NULL)
+        return NULL;
+    if (p != NULL)
+        memcpy(q, p, old_size < size ? old_size : size);
+    scan_mem_free(p);
+    return q;
+}
+
+// K, M or G (binary) suffix allowed
+int scan_mem_parse(const char* arg, size_t* out_size)
+{
+    char* end;
+    unsigned long long size;
+    unsigned int shift = 0;
+
+    errno = 0;
+    size = strtoull(arg, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+        end++;
+    if (errno != 0 || *end != '\0' || end == arg || size == 0 || size > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "Invalid memory size: %s\n", arg);
+        return 1;
+    }
+
+    *out_size = (size_t)size << shift;
+    return 0;
+}
+
+void scan_mem_report(void)
+{
+    struct rusage usage;
+
+    fprintf(stderr, "Peak memory: %.1f MiB in %zu allocations", atomic_load(&scan_mem.peak) / 1048576.0, atomic_load(&scan_mem.allocations));
+    if (scan_mem.budget != 0)
+        fprintf(stderr, " (budget: %.1f MiB)", scan_mem.budget / 1048576.0);
+    // ru_maxrss is in KiB
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stderr, ", %.1f MiB resident", usage.ru_maxrss / 1024.0);
+    fprintf(stderr, "\n");
+}
+
+// Fixed-size bump allocator for everything one thread (or the pool) needs for the whole scan, freed all at once
+struct scan_arena {
+    char* base;
+    size_t size;
+    size_t used;
+};
+
+static inline size_t scan_arena_round(size_t size)
+{
+    return (size + SCAN_ARENA_ALIGN - 1) & ~(size_t)(SCAN_ARENA_ALIGN - 1);
+}
+
+int scan_arena_init(struct scan_arena* arena, size_t size)
+{
+    arena->used = 0;
+    arena->size = size;
+    // Zeroed (which for a big arena is pages the kernel hasn't handed out yet)
+    arena->base = size > 0 ? scan_mem_calloc(1, size) : NULL;
+    return size > 0 && arena->base == NULL;
+}
+
+// NULL once the arena is used up (the sizes are worked out beforehand so that means a bug)
+void* scan_arena_alloc(struct scan_arena* arena, size_t size)
+{
+    char* p;
+
+    size = scan_arena_round(size);
+    if (size > arena->size - arena->used)
+        return NULL;
+    p = arena->base + arena->used;
+    arena->used += size;
+    return p;
+}
+
+void scan_arena_free(struct scan_arena* arena)
+{
+    scan_mem_free(arena->base);
+    arena->base = NULL;
+}
+
+// Growable slab of NUL terminated strings, referred to by offset so they survive the slab moving as it grows
+struct scan_slab {
+    char* data;
+    size_t len;
+    size_t capacity;
+};
+
+// Room for len bytes at the end of the slab, returns its offset (SIZE_MAX if it can't grow)
+size_t scan_slab_reserve(struct scan_slab* slab, size_t len)
+{
+    size_t offset = slab->len;
+
+    if (slab->capacity - slab->len < len) {
+        size_t capacity = slab->capacity ? slab->capacity : 65536;
+        char* data;
+
+        while (capacity - slab->len < len)
+            capacity *= 2;
+        if ((data = scan_mem_realloc(slab->data, capacity)) == NULL)
+            return SIZE_MAX;
+        slab->data = data;
+        slab->capacity = capacity;
+    }
+
+    slab->len += len;
+    return offset;
+}
+
+void scan_slab_free(struct scan_slab* slab)
+{
+    scan_mem_free(slab->data);
+    memset(slab, 0, sizeof(*slab));
+}
+
+// Timestamp index
+//
+// Key files never change once VanityGPG has written them, so rerunning against the same directory (e.g. with a
+// different primary key) doesn't need to read them again. The index is a flat file:
+//   header | records (sorted by timestamp) | record numbers sorted by inode | NUL terminated names
+// It's mapped read-only and binary searched by inode; a record only counts if the name, size and mtime match too
+// Being sorted by timestamp, the keys compatible with a primary key are a suffix of the records found with one more
+// binary search (see query mode)
+// With an index every file is stat'ed but only new or changed files are opened
+// Successfully extracted keys that are still in the source directory at the end of the run make up the new index,
+// which replaces the old one atomically (written to a temporary file and renamed over it)
+// Everything is in native byte order as the index is a cache for this machine and not an interchange format
+
+#define SCAN_INDEX_NAME ".pgp-timestamps.idx"
+#define SCAN_INDEX_MAGIC "PGPTSIDX"
+#define SCAN_INDEX_VERSION 2
+
+struct scan_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t names_size;
+};
+
+struct scan_index_record {
+    uint64_t ino;
+    int64_t mtime_ns;
+    // Offset of the file name in the names table
+    uint64_t name;
+    uint32_t size;
+    uint32_t timestamp;
+};
+
+struct scan_index {
+    // Index file path relative to dirfd
+    int dirfd;
+    const char* path;
+
+    // Previous index (mapped)
+    void* map;
+    size_t map_size;
+    const struct scan_index_record* records;
+    size_t count;
+    const uint32_t* by_ino;
+    const char* names;
+    size_t names_size;
+
+    // New index (built in memory as entries are reported)
+    struct scan_index_record* new_records;
+    size_t new_count;
+    size_t new_capacity;
+    char* new_names;
+    size_t new_names_size;
+    size_t new_names_capacity;
+    // Recorded entries that were read from their file this run
+    size_t misses;
+    int failed;
+};
+
+// A missing or unusable index is treated as empty (everything gets read and a fresh index written)
+int scan_index_open(struct scan_index* index, int dirfd, const char* path)
+{
+    const struct scan_index_header* header;
+    struct stat stbuf;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    index->dirfd = dirfd;
+    index->path = path;
+
+    if ((fd = openat(dirfd, path, O_RDONLY)) == -1) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Can't open timestamp index %s\n", path);
+        return 1;
+    }
+
+    if (fstat(fd, &stbuf) == -1 || (uint64_t)stbuf.st_size < sizeof(*header)) {
+        close(fd);
+        fprintf(stderr, "Ignoring invalid timestamp index: %s\n", path);
+        return 0;
+    }
+
+    index->map_size = stbuf.st_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        fprintf(stderr, "Can't map timestamp index %s\n", path);
+        return 1;
+    }
+
+    header = index->map;
+    if (memcmp(header->magic, SCAN_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != SCAN_INDEX_VERSION ||
+        header->record_size != sizeof(struct scan_index_record) ||
+        header->count > (index->map_size - sizeof(*header)) / (sizeof(struct scan_index_record) + sizeof(uint32_t)) ||
+        header->names_size != index->map_size - sizeof(*header) - header->count * (sizeof(struct scan_index_record) + sizeof(uint32_t)) ||
+        (header->names_size > 0 && ((const char*)index->map)[index->map_size - 1] != '\0')) {
+        fprintf(stderr, "Ignoring invalid timestamp index: %s\n", path);
+        return 0;
+    }
+
+    index->records = (const struct scan_index_record*)(header + 1);
+    index->count = header->count;
+    index->by_ino = (const uint32_t*)(index->records + index->count);
+    index->names = (const char*)(index->by_ino + index->count);
+    index->names_size = header->names_size;
+
+    // The whole index is going to be needed so start reading it in now
+    madvise(index->map, index->map_size, MADV_WILLNEED);
+
+    return 0;
+}
+
+void scan_index_close(struct scan_index* index)
+{
+    if (index->map != NULL)
+        munmap(index->map, index->map_size);
+    scan_mem_free(index->new_records);
+    scan_mem_free(index->new_names);
+}
+
+// Returns 0 and the timestamp if the index has an up to date record of this (stat'ed) entry
+int scan_index_lookup(const struct scan_index* index, const struct scan_entry* entry, unsigned int* out_timestamp)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->by_ino[mid] < index->count && index->records[index->by_ino[mid]].ino < (uint64_t)entry->ino)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Hard links share an inode so check every record for it
+    for (; low < index->count && index->by_ino[low] < index->count && index->records[index->by_ino[low]].ino == (uint64_t)entry->ino; low++) {
+        const struct scan_index_record* record = &index->records[index->by_ino[low]];
+
+        if (record->size == entry->size && record->mtime_ns == entry->mtime_ns && record->name < index->names_size &&
+            strcmp(index->names + record->name, entry->name) == 0) {
+            *out_timestamp = record->timestamp;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Append a record (name and all) to the new index
+void scan_index_add_record(struct scan_index* index, const struct scan_index_record* record, const char* name)
+{
+    struct scan_index_record* new_record;
+    size_t name_len;
+
+    if (index->failed)
+        return;
+
+    name_len = strlen(name) + 1;
+    // Record numbers have to fit in the inode order table
+    if (index->new_count == UINT32_MAX)
+        goto fail;
+    if (index->new_count == index->new_capacity) {
+        size_t capacity = index->new_capacity ? index->new_capacity * 2 : 4096;
+        struct scan_index_record* records = scan_mem_realloc(index->new_records, capacity * sizeof(*records));
+        if (records == NULL)
+            goto fail;
+        index->new_records = records;
+        index->new_capacity = capacity;
+    }
+    if (index->new_names_capacity - index->new_names_size < name_len) {
+        size_t capacity = index->new_names_capacity ? index->new_names_capacity * 2 : 65536;
+        char* names = scan_mem_realloc(index->new_names, capacity);
+        if (names == NULL)
+            goto fail;
+        index->new_names = names;
+        index->new_names_capacity = capacity;
+    }
+
+    new_record = &index->new_records[index->new_count++];
+    *new_record = *record;
+    new_record->name = index->new_names_size;
+    memcpy(index->new_names + index->new_names_size, name, name_len);
+    index->new_names_size += name_len;
+    return;
+
+fail:
+    fprintf(stderr, "Failed to allocate timestamp index, it won't be updated\n");
+    index->failed = 1;
+}
+
+// Called for every entry in turn once it's been processed (only from one thread at a time)
+void scan_index_add(const struct scan_config* config, const struct scan_entry* entry)
+{
+    struct scan_index* index = config->index;
+    struct scan_index_record record;
+
+    // Only keys that are still in the source directory
+    if (entry->status != SCAN_EXTRACTED || entry->extract_status != PGP_KEY_OK ||
+        (config->action == SCAN_ACTION_MOVE && entry->move_status == SCAN_MOVE_DONE) || entry->size > UINT32_MAX)
+        return;
+
+    record.ino = entry->ino;
+    record.mtime_ns = entry->mtime_ns;
+    record.size = entry->size;
+    record.timestamp = entry->timestamp;
+    scan_index_add_record(index, &record, entry->name);
+
+    if (!entry->indexed)
+        index->misses++;
+}
+
+// Drop a key that was moved after it was recorded (see scan_select_finish)
+void scan_index_remove(struct scan_index* index, const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < index->new_count; i++) {
+        if (strcmp(index->new_names + index->new_records[i].name, name) == 0) {
+            // Records are sorted when the index is written so the order doesn't matter
+            index->new_records[i] = index->new_records[--index->new_count];
+            return;
+        }
+    }
+}
+
+// Index of the first record with a timestamp of at least timestamp (count if there isn't one)
+size_t scan_index_lower_bound(const struct scan_index* index, unsigned int timestamp)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->records[mid].timestamp < timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+int scan_index_record_compare(const void* a, const void* b)
+{
+    const struct scan_index_record* ra = a;
+    const struct scan_index_record* rb = b;
+
+    if (ra->timestamp != rb->timestamp)
+        return (ra->timestamp > rb->timestamp) - (ra->timestamp < rb->timestamp);
+    return (ra->ino > rb->ino) - (ra->ino < rb->ino);
+}
+
+struct scan_index_ino_order {
+    uint64_t ino;
+    uint32_t record;
+};
+
+int scan_index_ino_order_compare(const void* a, const void* b)
+{
+    const struct scan_index_ino_order* oa = a;
+    const struct scan_index_ino_order* ob = b;
+
+    return (oa->ino > ob->ino) - (oa->ino < ob->ino);
+}
+
+int scan_index_write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+// Replace the index file with the new index (unless nothing changed)
+int scan_index_write(struct scan_index* index)
+{
+    struct scan_index_header header;
+    struct scan_index_ino_order* order;
+    uint32_t* by_ino;
+    char* tmp_path;
+    size_t i;
+    int fd;
+    int ret;
+
+    if (index->failed)
+        return 1;
+    if (index->misses == 0 && index->new_count == index->count)
+        return 0;
+
+    qsort(index->new_records, index->new_count, sizeof(*index->new_records), scan_index_record_compare);
+
+    order = scan_mem_alloc(index->new_count * sizeof(*order) + 1);
+    by_ino = scan_mem_alloc(index->new_count * sizeof(*by_ino) + 1);
+    if (order == NULL || by_ino == NULL) {
+        fprintf(stderr, "Failed to allocate timestamp index\n");
+        scan_mem_free(order);
+        scan_mem_free(by_ino);
+        return 1;
+    }
+    for (i = 0; i < index->new_count; i++) {
+        order[i].ino = index->new_records[i].ino;
+        order[i].record = i;
+    }
+    qsort(order, index->new_count, sizeof(*order), scan_index_ino_order_compare);
+    for (i = 0; i < index->new_count; i++)
+        by_ino[i] = order[i].record;
+    scan_mem_free(order);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCAN_INDEX_MAGIC, sizeof(header.magic));
+    header.version = SCAN_INDEX_VERSION;
+    header.record_size = sizeof(struct scan_index_record);
+    header.count = index->new_count;
+    header.names_size = index->new_names_size;
+
+    tmp_path = scan_mem_alloc(strlen(index->path) + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Failed to allocate timestamp index\n");
+        scan_mem_free(by_ino);
+        return 1;
+    }
+    strcpy(tmp_path, index->path);
+    strcat(tmp_path, ".tmp");
+
+    if ((fd = openat(index->dirfd, tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        fprintf(stderr, "Can't create timestamp index %s\n", tmp_path);
+        scan_mem_free(tmp_path);
+        scan_mem_free(by_ino);
+        return 1;
+    }
+
+    ret = scan_index_write_all(fd, &header, sizeof(header)) != 0 ||
+          scan_index_write_all(fd, index->new_records, index->new_count * sizeof(*index->new_records)) != 0 ||
+          scan_index_write_all(fd, by_ino, index->new_count * sizeof(*by_ino)) != 0 ||
+          scan_index_write_all(fd, index->new_names, index->new_names_size) != 0 ||
+          fsync(fd) == -1;
+    ret |= close(fd) == -1;
+    if (ret == 0)
+        ret = renameat(index->dirfd, tmp_path, index->dirfd, index->path) == -1;
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write timestamp index %s\n", index->path);
+        unlinkat(index->dirfd, tmp_path, 0);
+    }
+    scan_mem_free(tmp_path);
+    scan_mem_free(by_ino);
+    return ret;
+}
+
+// Moving keys
+//
+// Keys are moved with renameat2(RENAME_NOREPLACE) so a key can never replace one of the same name already in the
+// destination (plain renameat would silently). Where the flag isn't supported (old kernel, some file systems, other
+// platforms) the destination is checked first, which leaves a small window for a race
+// A destination on another file system (EXDEV) gets a copy instead: created O_EXCL, filled with copy_file_range
+// (falling back to sendfile and then read/write) and left open. Each thread keeps up to SCAN_MOVE_MAX_PENDING copies
+// in flight and finishes them together: every copy is fsync'ed (plus its directory) before any of the originals are
+// unlinked, so a key is never only in the page cache when it disappears from the source directory
+// Pending copies are always finished before the batch they're in is reported
+
+// Copies in flight per thread (each holds an open fd)
+#define SCAN_MOVE_MAX_PENDING 64
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+struct scan_move_pending {
+    int src_dirfd;
+    const char* name;
+    int dst_dirfd;
+    const char* dst_name;
+    // The copy (open for writing)
+    int fd;
+    // Set once the move is finished
+    int* status;
+};
+
+struct scan_mover {
+    struct scan_move_pending* pending;
+    size_t pending_count;
+};
+
+// Turns the outcome of a renameat2(RENAME_NOREPLACE) (0 or an errno value) into a scan_move_status
+int scan_move_rename_result(int error, int src_dirfd, const char* name, int dst_dirfd, const char* dst_name)
+{
+    struct stat stbuf;
+
+    // RENAME_NOREPLACE isn't supported here so check for an existing file ourselves
+    if (error == EINVAL || error == ENOSYS) {
+        if (fstatat(dst_dirfd, dst_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+            return SCAN_MOVE_EXISTS;
+        if (errno != ENOENT)
+            return SCAN_MOVE_FAILED;
+        error = renameat(src_dirfd, name, dst_dirfd, dst_name) == -1 ? errno : 0;
+    }
+
+    if (error == 0)
+        return SCAN_MOVE_DONE;
+    if (error == EEXIST)
+        return SCAN_MOVE_EXISTS;
+    if (error == EXDEV)
+        return SCAN_MOVE_CROSS_DEVICE;
+    return SCAN_MOVE_FAILED;
+}
+
+int scan_move_rename(int src_dirfd, const char* name, int dst_dirfd, const char* dst_name)
+{
+    int error = EINVAL;
+
+#if defined(__linux__) && defined(SYS_renameat2)
+    error = syscall(SYS_renameat2, src_dirfd, name, dst_dirfd, dst_name, RENAME_NOREPLACE) == -1 ? errno : 0;
+#endif
+
+    return scan_move_rename_result(error, src_dirfd, name, dst_dirfd, dst_name);
+}
+
+// Copies size bytes from the current offset of in to out, buf (of buf_size bytes) is only used for read/write
+int scan_move_copy_data(int in, int out, off_t size, unsigned char* buf, size_t buf_size)
+{
+    ssize_t ret = 0;
+
+#ifdef __linux__
+    // In-kernel copies: copy_file_range (which can reflink or copy server side on NFS) then sendfile
+    while (size > 0 && (ret = copy_file_range(in, NULL, out, NULL, size, 0)) > 0)
+        size -= ret;
+    if (size == 0 || ret == 0)
+        return 0;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        return 1;
+
+    while (size > 0 && (ret = sendfile(out, in, NULL, size)) > 0)
+        size -= ret;
+    if (size == 0 || ret == 0)
+        return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+        return 1;
+#endif
+
+    while (size > 0 && (ret = read(in, buf, size < (off_t)buf_size ? (size_t)size : buf_size)) > 0) {
+        if (scan_index_write_all(out, buf, ret) != 0)
+            return 1;
+        size -= ret;
+    }
+
+    return ret < 0;
+}
+
+// Finishes every pending copy: fsync the copies and their directories, then unlink the originals
+void scan_move_flush(struct scan_mover* mover)
+{
+    size_t i;
+    int last_dirfd = -1;
+
+    for (i = 0; i < mover->pending_count; i++) {
+        struct scan_move_pending* pending = &mover->pending[i];
+
+        *pending->status = fsync(pending->fd) == 0 ? SCAN_MOVE_DONE : SCAN_MOVE_FAILED;
+        close(pending->fd);
+        if (*pending->status != SCAN_MOVE_DONE)
+            unlinkat(pending->dst_dirfd, pending->dst_name, 0);
+
+        // Copies usually all go to the same directory
+        if (pending->dst_dirfd != last_dirfd) {
+            fsync(pending->dst_dirfd);
+            last_dirfd = pending->dst_dirfd;
+        }
+    }
+
+    for (i = 0; i < mover->pending_count; i++) {
+        struct scan_move_pending* pending = &mover->pending[i];
+
+        // Rather two copies than none, but report it as not moved
+        if (*pending->status == SCAN_MOVE_DONE && unlinkat(pending->src_dirfd, pending->name, 0) == -1) {
+            unlinkat(pending->dst_dirfd, pending->dst_name, 0);
+            *pending->status = SCAN_MOVE_FAILED;
+        }
+    }
+
+    mover->pending_count = 0;
+}
+
+// Copy a key to another file system, the move is finished (and *status set) by scan_move_flush
+// Returns a scan_move_status if it failed straight away, SCAN_MOVE_DONE if it's pending
+int scan_move_copy(struct scan_mover* mover, unsigned char* buf, size_t buf_size, int src_dirfd, const char* name,
+                   int dst_dirfd, const char* dst_name, int* status)
+{
+    struct scan_move_pending* pending;
+    struct stat stbuf;
+    int in;
+    int out;
+
+    if (mover->pending_count == SCAN_MOVE_MAX_PENDING)
+        scan_move_flush(mover);
+
+    if ((in = openat(src_dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+        return SCAN_MOVE_FAILED;
+    if (fstat(in, &stbuf) == -1) {
+        close(in);
+        return SCAN_MOVE_FAILED;
+    }
+
+    if ((out = openat(dst_dirfd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, stbuf.st_mode & 07777)) == -1) {
+        close(in);
+        return errno == EEXIST ? SCAN_MOVE_EXISTS : SCAN_MOVE_FAILED;
+    }
+
+    if (scan_move_copy_data(in, out, stbuf.st_size, buf, buf_size) != 0) {
+        close(in);
+        close(out);
+        unlinkat(dst_dirfd, dst_name, 0);
+        return SCAN_MOVE_FAILED;
+    }
+    close(in);
+
+    pending = &mover->pending[mover->pending_count++];
+    pending->src_dirfd = src_dirfd;
+    pending->name = name;
+    pending->dst_dirfd = dst_dirfd;
+    pending->dst_name = dst_name;
+    pending->fd = out;
+    pending->status = status;
+    // Until the copy is on disk and the original is gone
+    *status = SCAN_MOVE_FAILED;
+    return SCAN_MOVE_DONE;
+}
+
+// First and closest matches
+//
+// --first=K stops the scan as soon as K compatible keys have been found. Workers claim each compatible key from an
+// atomic counter and any key claimed past K is passed over. Once the counter reaches K the enumerators stop handing
+// out entries and the workers drop the batches still queued without reading them
+// --closest=K keeps the K compatible keys with the timestamps closest to (and not before) their primary key's. Each
+// thread has a bounded max-heap of its best candidates so a key costs one compare against the worst of them unless
+// it's better. The heaps are merged once the scan is over and only then are the winners acted on and reported
+// Candidates are kept by their path relative to the source directory, so like --files-from paths they're moved
+// straight into the destination directory (even in a recursive scan)
+
+struct scan_select {
+    // K
+    size_t limit;
+    int closest;
+    // --first: compatible keys claimed so far
+    atomic_size_t claimed;
+    // Signalled when the K-th key is claimed so a watch stops waiting for events (-1 if not watching)
+    int wake_fd;
+};
+
+struct scan_candidate {
+    // Timestamp minus the primary key's (candidates are ordered by this, then by path)
+    unsigned int distance;
+    unsigned int timestamp;
+    char* path;
+    // Bytes allocated for path
+    size_t path_size;
+};
+
+// Max-heap so the worst candidate is the one at the top to be replaced
+struct scan_candidates {
+    struct scan_candidate* heap;
+    size_t count;
+};
+
+int scan_candidate_compare(const struct scan_candidate* a, const struct scan_candidate* b)
+{
+    if (a->distance != b->distance)
+        return (a->distance > b->distance) - (a->distance < b->distance);
+    return strcmp(a->path, b->path);
+}
+
+int scan_candidate_sort_compare(const void* a, const void* b)
+{
+    return scan_candidate_compare(a, b);
+}
+
+void scan_candidates_sift_down(struct scan_candidates* candidates, size_t i)
+{
+    struct scan_candidate* heap = candidates->heap;
+
+    for (;;) {
+        size_t largest = i;
+        size_t child = 2 * i + 1;
+        struct scan_candidate tmp;
+
+        if (child < candidates->count && scan_candidate_compare(&heap[child], &heap[largest]) > 0)
+            largest = child;
+        if (child + 1 < candidates->count && scan_candidate_compare(&heap[child + 1], &heap[largest]) > 0)
+            largest = child + 1;
+        if (largest == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+// Keep a key if it's one of the limit best this thread has seen so far
+// The path is copied into the storage of the candidate it replaces, so once the heap is full a copy is only
+// allocated for a path longer than the one it evicts (and only ever up to limit of them before that)
+void scan_candidates_add(struct scan_candidates* candidates, size_t limit, const struct scan_candidate* candidate)
+{
+    struct scan_candidate* heap = candidates->heap;
+    size_t path_size = strlen(candidate->path) + 1;
+    size_t i;
+    char* path = NULL;
+    size_t size = 0;
+
+    if (candidates->count == limit && scan_candidate_compare(candidate, &heap[0]) >= 0)
+        return;
+
+    // Replace the worst
+    if (candidates->count == limit) {
+        path = heap[0].path;
+        size = heap[0].path_size;
+    }
+    if (size < path_size) {
+        // Rounded up so paths of about the same length keep fitting
+        size = scan_arena_round(path_size);
+        if ((path = scan_mem_realloc(path, size)) == NULL) {
+            fprintf(stderr, "Failed to allocate candidates\n");
+            return;
+        }
+        if (candidates->count == limit) {
+            heap[0].path = path;
+            heap[0].path_size = size;
+        }
+    }
+    memcpy(path, candidate->path, path_size);
+
+    if (candidates->count == limit) {
+        heap[0].distance = candidate->distance;
+        heap[0].timestamp = candidate->timestamp;
+        scan_candidates_sift_down(candidates, 0);
+        return;
+    }
+
+    // Sift up
+    for (i = candidates->count++; i > 0 && scan_candidate_compare(candidate, &heap[(i - 1) / 2]) > 0; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = *candidate;
+    heap[i].path = path;
+    heap[i].path_size = size;
+}
+
+void scan_candidates_free(struct scan_candidates* candidates)
+{
+    size_t i;
+
+    for (i = 0; i < candidates->count; i++)
+        scan_mem_free(candidates->heap[i].path);
+}
+
+// --first has found all the keys it was after so the rest of the scan is dropped
+static inline int scan_select_done(const struct scan_config* config)
+{
+    const struct scan_select* selection = config->select;
+
+    return selection != NULL && !selection->closest && atomic_load_explicit(&selection->claimed, memory_order_relaxed) >= selection->limit;
+}
+
+// Per-thread scratch space so the pipeline never allocates memory
+struct scan_buffers {
+    unsigned char* key;
+    struct scan_mover mover;
+    // --closest only
+    struct scan_candidates candidates;
+};
+
+// Arena space scan_buffers_init takes
+size_t scan_buffers_size(const struct scan_config* config)
+{
+    size_t size = scan_arena_round(PGP_KEY_HEADER_MAX_SIZE) + scan_arena_round(SCAN_MOVE_MAX_PENDING * sizeof(struct scan_move_pending));
+
+    if (config->select != NULL && config->select->closest)
+        size += scan_arena_round(config->select->limit * sizeof(struct scan_candidate));
+    return size;
+}
+
+int scan_buffers_init(struct scan_buffers* buffers, const struct scan_config* config, struct scan_arena* arena)
+{
+    buffers->key = scan_arena_alloc(arena, PGP_KEY_HEADER_MAX_SIZE);
+    buffers->mover.pending = scan_arena_alloc(arena, SCAN_MOVE_MAX_PENDING * sizeof(*buffers->mover.pending));
+    buffers->mover.pending_count = 0;
+    buffers->candidates.heap = NULL;
+    buffers->candidates.count = 0;
+    if (config->select != NULL && config->select->closest)
+        buffers->candidates.heap = scan_arena_alloc(arena, config->select->limit * sizeof(*buffers->candidates.heap));
+    if (buffers->key == NULL || buffers->mover.pending == NULL || (config->select != NULL && config->select->closest && buffers->candidates.heap == NULL)) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void scan_buffers_free(struct scan_buffers* buffers)
+{
+    scan_candidates_free(&buffers->candidates);
+}
+
+// Directories and hidden files are dropped as soon as they're enumerated without costing a syscall
+int scan_dirent_wanted(const char* name, unsigned char d_type)
+{
+    return name[0] != '.' && d_type != DT_DIR;
+}
+
+// --shard: a key belongs to the shard its path relative to the source directory (prefix + name) hashes to
+// The hash is 64 bit FNV-1a modulo the shard count, so any process (or host) seeing the same tree agrees on it
+// without talking to the others
+#define SCAN_FNV1A_BASIS 14695981039346656037ULL
+
+uint64_t scan_fnv1a(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+int scan_shard_wanted(const struct scan_config* config, const char* prefix, const char* name)
+{
+    if (config->shard_count == 0)
+        return 1;
+
+    return scan_fnv1a(scan_fnv1a(SCAN_FNV1A_BASIS, prefix, strlen(prefix)), name, strlen(name)) % config->shard_count ==
+           config->shard_index;
+}
+
+enum scan_entry_kind {
+    SCAN_KIND_SKIP,
+    SCAN_KIND_FILE,
+    // d_type can't tell us so it takes a stat
+    SCAN_KIND_STAT
+};
+
+// What the directory entry alone tells us about a file
+int scan_entry_kind(const struct scan_entry* entry)
+{
+    switch (entry->d_type) {
+    case DT_REG:
+        return SCAN_KIND_FILE;
+    // Symlinks have to be followed (like stat does) and some file systems don't fill in d_type at all
+    case DT_LNK:
+    case DT_UNKNOWN:
+        return SCAN_KIND_STAT;
+    }
+
+    // Directories, plus FIFOs, sockets and devices which stat as empty files
+    return SCAN_KIND_SKIP;
+}
+
+int scan_entry_dirfd(const struct scan_config* config, const struct scan_entry* entry)
+{
+    return entry->dir != NULL ? entry->dir->fd : config->source_dirfd;
+}
+
+int scan_tree_dest_fd(const struct scan_config* config, struct scan_dir* dir);
+
+int scan_entry_dest_dirfd(const struct scan_config* config, const struct scan_entry* entry)
+{
+    // A recursive scan only has one destination (config->dest_dirfd) to mirror the tree under
+    if (entry->dir != NULL)
+        return scan_tree_dest_fd(config, (struct scan_dir*)entry->dir);
+    return config->filter.routes[scan_filter_route(&config->filter, entry->timestamp)].dest_fd;
+}
+
+// Path of the entry's directory relative to the source directory (for printing)
+const char* scan_entry_prefix(const struct scan_entry* entry)
+{
+    return entry->dir != NULL ? entry->dir->prefix : "";
+}
+
+// Keys moved from a file list path (which may have directories in it) all go straight into the destination directory
+const char* scan_entry_dest_name(const struct scan_entry* entry)
+{
+    const char* slash = strrchr(entry->name, '/');
+
+    return slash != NULL ? slash + 1 : entry->name;
+}
+
+// Testing with GPG confirms that a subkey with the same timestamp as its primary key is also valid
+int scan_entry_compatible(const struct scan_config* config, const struct scan_entry* entry)
+{
+    return config->match && entry->extract_status == PGP_KEY_OK && !entry->passed_over &&
+           scan_filter_route(&config->filter, entry->timestamp) != -1;
+}
+
+int scan_entry_wants_action(const struct scan_config* config, const struct scan_entry* entry)
+{
+    // Without creating a destination that isn't there yet
+    int dest_fd = entry->dir != NULL ? atomic_load(&entry->dir->dest_fd) : scan_entry_dest_dirfd(config, entry);
+
+    return config->action != SCAN_ACTION_NONE && scan_entry_compatible(config, entry) && dest_fd != -1;
+}
+
+// With --checkpoint keys are acted on as they're retired instead, in order (see Checkpoints)
+int scan_entry_acts_now(const struct scan_config* config, const struct scan_entry* entry)
+{
+    return config->checkpoint == NULL && scan_entry_wants_action(config, entry);
+}
+
+// Whether a compatible key is acted on now or passed over (see "First and closest matches")
+// Called once for each extracted key (buffers->key is free again by then)
+void scan_select_entry(const struct scan_config* config, struct scan_buffers* buffers, struct scan_entry* entry)
+{
+    struct scan_select* selection = config->select;
+    struct scan_candidate candidate;
+    size_t claimed;
+
+    if (selection == NULL || !scan_entry_compatible(config, entry))
+        return;
+
+    if (!selection->closest) {
+        claimed = atomic_fetch_add_explicit(&selection->claimed, 1, memory_order_relaxed);
+        if (claimed >= selection->limit)
+            entry->passed_over = 1;
+#ifdef __linux__
+        else if (claimed + 1 == selection->limit && selection->wake_fd != -1)
+            eventfd_write(selection->wake_fd, 1);
+#endif
+        return;
+    }
+
+    entry->passed_over = 1;
+    candidate.distance = entry->timestamp - config->filter.routes[scan_filter_route(&config->filter, entry->timestamp)].timestamp;
+    candidate.timestamp = entry->timestamp;
+    candidate.path = (char*)buffers->key;
+    if (snprintf(candidate.path, PGP_KEY_HEADER_MAX_SIZE, "%s%s", scan_entry_prefix(entry), entry->name) >= PGP_KEY_HEADER_MAX_SIZE)
+        return;
+    scan_candidates_add(&buffers->candidates, selection->limit, &candidate);
+}
+
+void scan_entry_reset(struct scan_entry* entry)
+{
+    entry->status = SCAN_SKIPPED;
+    entry->indexed = 0;
+    entry->move_status = -1;
+    entry->passed_over = 0;
+}
+
+// Take in a stat result and answer from the index if possible
+// Leaves the entry SCAN_PENDING if the file still has to be read
+void scan_entry_stat(const struct scan_config* config, struct scan_entry* entry, int is_dir, uint64_t ino, uint64_t size, int64_t mtime_ns)
+{
+    // Skip directories and empty files
+    if (is_dir || size == 0)
+        return;
+
+    entry->ino = ino;
+    entry->size = size;
+    entry->mtime_ns = mtime_ns;
+
+    if (config->index != NULL && scan_index_lookup(config->index, entry, &entry->timestamp) == 0) {
+        entry->status = SCAN_EXTRACTED;
+        entry->extract_status = PGP_KEY_OK;
+        entry->indexed = 1;
+        return;
+    }
+
+    entry->status = SCAN_PENDING;
+}
+
+// Record how the rename of a compatible key went, falling back to a copy if it's going to another file system
+void scan_move_entry_status(const struct scan_config* config, struct scan_buffers* buffers, struct scan_entry* entry, int status)
+{
+    entry->move_status = status;
+    if (status == SCAN_MOVE_CROSS_DEVICE)
+        entry->move_status = scan_move_copy(&buffers->mover, buffers->key, PGP_KEY_HEADER_MAX_SIZE, scan_entry_dirfd(config, entry),
+                                            entry->name, scan_entry_dest_dirfd(config, entry), scan_entry_dest_name(entry),
+                                            &entry->move_status);
+}
+
+// Links only ever fail or find a file of the same name in the way
+int scan_link_status(int error)
+{
+    if (error == 0)
+        return SCAN_MOVE_DONE;
+    return error == EEXIST ? SCAN_MOVE_EXISTS : SCAN_MOVE_FAILED;
+}
+
+// Record how the action on a compatible key went given the errno value (0 for success) of its syscall
+void scan_act_entry_result(const struct scan_config* config, struct scan_buffers* buffers, struct scan_entry* entry, int error)
+{
+    if (config->action == SCAN_ACTION_MOVE)
+        scan_move_entry_status(config, buffers, entry, scan_move_rename_result(error, scan_entry_dirfd(config, entry), entry->name,
+                                                                               scan_entry_dest_dirfd(config, entry), scan_entry_dest_name(entry)));
+    else
+        entry->move_status = scan_link_status(error);
+}
+
+int scan_pack_extract(const struct scan_config* config, const struct scan_entry* entry);
+
+void scan_act_entry(const struct scan_config* config, struct scan_buffers* buffers, struct scan_entry* entry)
+{
+    int src_dirfd = scan_entry_dirfd(config, entry);
+    int dst_dirfd = scan_entry_dest_dirfd(config, entry);
+    const char* dst_name = scan_entry_dest_name(entry);
+    char* target = (char*)buffers->key;
+
+    switch (config->action) {
+    case SCAN_ACTION_MOVE:
+        scan_move_entry_status(config, buffers, entry, scan_move_rename(src_dirfd, entry->name, dst_dirfd, dst_name));
+        break;
+    case SCAN_ACTION_LINK:
+        entry->move_status = scan_link_status(linkat(src_dirfd, entry->name, dst_dirfd, dst_name, 0) == -1 ? errno : 0);
+        break;
+    case SCAN_ACTION_SYMLINK:
+        // Absolute so the link works from anywhere in the destination
+        if (snprintf(target, PGP_KEY_HEADER_MAX_SIZE, "%s/%s%s", config->source_realpath, scan_entry_prefix(entry), entry->name) >= PGP_KEY_HEADER_MAX_SIZE) {
+            entry->move_status = SCAN_MOVE_FAILED;
+            break;
+        }
+        entry->move_status = scan_link_status(symlinkat(target, dst_dirfd, dst_name) == -1 ? errno : 0);
+        break;
+    case SCAN_ACTION_EXTRACT:
+        entry->move_status = scan_pack_extract(config, entry);
+        break;
+    }
+}
+
+void scan_process_entry(const struct scan_config* config, struct scan_buffers* buffers, struct scan_entry* entry)
+{
+    struct stat stbuf;
+    int kind = scan_entry_kind(entry);
+
+    scan_entry_reset(entry);
+
+    if (kind == SCAN_KIND_SKIP)
+        return;
+
+    // The index needs the inode, size and mtime of every file
+    if (kind == SCAN_KIND_STAT || config->index != NULL) {
+        SCAN_STATS_TIME(start);
+        int ret = fstatat(scan_entry_dirfd(config, entry), entry->name, &stbuf, 0);
+
+        SCAN_STATS_STAGE(SCAN_STAGE_STAT, start);
+        if (ret == -1) {
+            entry->status = SCAN_STAT_FAILED;
+            return;
+        }
+
+        scan_entry_stat(config, entry, S_ISDIR(stbuf.st_mode), stbuf.st_ino, stbuf.st_size,
+                        (int64_t)stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec);
+        if (entry->status == SCAN_SKIPPED)
+            return;
+    }
+
+    if (!entry->indexed) {
+        // Parsed where it lies in the pack, looking no further than a key file read would
+        if (config->pack != NULL)
+            entry->extract_status = entry->data == NULL ? PGP_KEY_ERR_READ :
+                                    pgp_key_extract_timestamp_buf(entry->data, entry->size < PGP_KEY_HEADER_MAX_SIZE ? entry->size : PGP_KEY_HEADER_MAX_SIZE,
+                                                                  &entry->timestamp);
+        else
+            entry->extract_status = pgp_key_extract_timestamp(scan_entry_dirfd(config, entry), entry->name, buffers->key, &entry->timestamp);
+
+        // Skip empty files
+        // This can happen if VanityGPG exits abruptly before writing key contents to a created file
+        // For regular files the zero byte read tells us this so we don't need a stat for the size
+        if (entry->extract_status == PGP_KEY_ERR_EMPTY) {
+            entry->status = SCAN_SKIPPED;
+            return;
+        }
+        entry->status = SCAN_EXTRACTED;
+    }
+
+    scan_select_entry(config, buffers, entry);
+    if (scan_entry_acts_now(config, entry)) {
+        SCAN_STATS_TIME(start);
+        scan_act_entry(config, buffers, entry);
+        SCAN_STATS_STAGE(SCAN_STAGE_RENAME, start);
+    }
+}
+
+// Output
+//
+// Per-key lines are formatted into large buffers that are written out with one write() each instead of going
+// through stdio line by line (stderr being unbuffered, that was a syscall per message)
+// In ordered mode only one thread reports at a time so they all share the pool's buffers, which keeps the output in
+// order. In unordered mode each worker has buffers of its own
+// Buffers are flushed when full and at the end (and after every round of reporting in watch mode)
+
+#define SCAN_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+enum scan_output_format {
+    // Human readable messages (the default)
+    SCAN_OUTPUT_TEXT,
+    // path<TAB>timestamp for every key
+    SCAN_OUTPUT_TSV,
+    // struct scan_output_record + path for every key
+    SCAN_OUTPUT_BINARY
+};
+
+// Binary output record (big endian) followed by name_len bytes of path relative to the source directory
+struct scan_output_record {
+    uint32_t timestamp;
+    uint16_t name_len;
+    // enum pgp_key_status
+    uint8_t status;
+    // 0 = not moved, 1 = moved, 2 = failed to move
+    uint8_t move;
+};
+
+// Manifests
+//
+// A manifest lists keys by their path relative to the source directory, so the manifests of several shards of one
+// tree (see --shard) can be put back together with merge
+// Text: path (with --manifest-timestamps, TAB timestamp) per line
+// Binary (--manifest-binary): this header, then a struct scan_output_record + path for each key, status always 0
+// The header has the shard of a --shard scan, 0 of 1 for the whole tree and 0 of 0 for a merge of only some shards
+
+#define SCAN_MANIFEST_MAGIC "PGPMFST1"
+
+struct scan_manifest_header {
+    char magic[8];
+    // Big endian
+    uint32_t shard_index;
+    uint32_t shard_count;
+};
+
+struct scan_output_buffer {
+    int fd;
+    size_t len;
+    char* data;
+    // Start of the line or record being written (see scan_output_end)
+    size_t record;
+};
+
+struct scan_output {
+    struct scan_output_buffer out;
+    struct scan_output_buffer err;
+    // data is NULL without a manifest
+    struct scan_output_buffer manifest;
+};
+
+// Arena space scan_output_init takes
+size_t scan_output_size(const struct scan_config* config)
+{
+    return (config->manifest_fd != -1 ? 3 : 2) * scan_arena_round(SCAN_OUTPUT_BUFFER_SIZE);
+}
+
+int scan_output_init(struct scan_output* output, const struct scan_config* config, struct scan_arena* arena)
+{
+    output->out.fd = STDOUT_FILENO;
+    output->out.len = 0;
+    output->out.record = 0;
+    output->out.data = scan_arena_alloc(arena, SCAN_OUTPUT_BUFFER_SIZE);
+    output->err.fd = STDERR_FILENO;
+    output->err.len = 0;
+    output->err.record = 0;
+    output->err.data = scan_arena_alloc(arena, SCAN_OUTPUT_BUFFER_SIZE);
+    output->manifest.fd = config->manifest_fd;
+    output->manifest.len = 0;
+    output->manifest.record = 0;
+    output->manifest.data = config->manifest_fd != -1 ? scan_arena_alloc(arena, SCAN_OUTPUT_BUFFER_SIZE) : NULL;
+
+    if (output->out.data == NULL || output->err.data == NULL || (config->manifest_fd != -1 && output->manifest.data == NULL)) {
+        fprintf(stderr, "Failed to allocate output buffers\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// With -u every worker's buffers share the same fds and a write() of more than PIPE_BUF bytes to a pipe can be split
+// up between other writes, so buffers are written out one at a time
+pthread_mutex_t scan_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void scan_output_flush_buffer(struct scan_output_buffer* buffer)
+{
+    const char* p = buffer->data;
+    size_t len = buffer->len;
+    SCAN_STATS_TIME(start);
+
+    if (len == 0)
+        return;
+
+    pthread_mutex_lock(&scan_output_lock);
+    while (len > 0) {
+        ssize_t ret = write(buffer->fd, p, len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere left to report this (e.g. the end of a pipe went away)
+            break;
+        }
+        p += ret;
+        len -= ret;
+    }
+    pthread_mutex_unlock(&scan_output_lock);
+
+    SCAN_STATS_STAGE(SCAN_STAGE_OUTPUT, start);
+    buffer->len = 0;
+    buffer->record = 0;
+}
+
+void scan_output_flush(struct scan_output* output)
+{
+    if (output->out.data != NULL)
+        scan_output_flush_buffer(&output->out);
+    if (output->err.data != NULL)
+        scan_output_flush_buffer(&output->err);
+    if (output->manifest.data != NULL)
+        scan_output_flush_buffer(&output->manifest);
+}
+
+void scan_output_write(struct scan_output_buffer* buffer, const void* data, size_t len)
+{
+    if (SCAN_OUTPUT_BUFFER_SIZE - buffer->len < len) {
+        // Only the whole lines and records go out, the start of the one being written moves to the front
+        size_t record = buffer->record;
+        size_t partial = buffer->len - record;
+
+        buffer->len = record;
+        scan_output_flush_buffer(buffer);
+        memmove(buffer->data, buffer->data + record, partial);
+        buffer->len = partial;
+
+        // Too long to ever be buffered whole so it goes out in pieces
+        if (SCAN_OUTPUT_BUFFER_SIZE - partial < len) {
+            scan_output_flush_buffer(buffer);
+            if (len > SCAN_OUTPUT_BUFFER_SIZE) {
+                struct scan_output_buffer direct = { buffer->fd, len, (char*)data, 0 };
+                scan_output_flush_buffer(&direct);
+                return;
+            }
+        }
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+// Marks the end of a line or record: a full buffer is only written out up to the last one, so every write() holds
+// whole lines (otherwise those of the workers sharing a fd with -u, or of stdout and stderr, end up mixed together)
+void scan_output_end(struct scan_output_buffer* buffer)
+{
+    buffer->record = buffer->len;
+}
+
+void scan_output_str(struct scan_output_buffer* buffer, const char* str)
+{
+    scan_output_write(buffer, str, strlen(str));
+}
+
+// Two digits at a time from the end
+static const char scan_output_digits[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+void scan_output_uint(struct scan_output_buffer* buffer, unsigned int value)
+{
+    char digits[10];
+    char* p = digits + sizeof(digits);
+
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, &scan_output_digits[value % 100 * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &scan_output_digits[value * 2], 2);
+    }
+    else
+        *--p = '0' + value;
+
+    scan_output_write(buffer, p, digits + sizeof(digits) - p);
+}
+
+// Path of the entry relative to the source directory
+void scan_output_rel_path(struct scan_output_buffer* buffer, const struct scan_entry* entry)
+{
+    scan_output_str(buffer, scan_entry_prefix(entry));
+    scan_output_str(buffer, entry->name);
+}
+
+void scan_output_path(struct scan_output_buffer* buffer, const struct scan_config* config, const struct scan_entry* entry)
+{
+    scan_output_str(buffer, config->source_dir);
+    scan_output_write(buffer, "/", 1);
+    scan_output_rel_path(buffer, entry);
+}
+
+// "<label>: <path>" line
+void scan_output_line(struct scan_output_buffer* buffer, const char* label, const struct scan_config* config, const struct scan_entry* entry)
+{
+    scan_output_str(buffer, label);
+    scan_output_write(buffer, ": ", 2);
+    scan_output_path(buffer, config, entry);
+    scan_output_write(buffer, "\n", 1);
+    scan_output_end(buffer);
+}
+
+void scan_output_binary_record(struct scan_output_buffer* buffer, const struct scan_entry* entry)
+{
+    const char* prefix = scan_entry_prefix(entry);
+    size_t prefix_len = strlen(prefix);
+    size_t name_len = strlen(entry->name);
+    struct scan_output_record record;
+
+    record.timestamp = htonl(entry->extract_status == PGP_KEY_OK ? entry->timestamp : 0);
+    record.name_len = htons(prefix_len + name_len);
+    record.status = entry->extract_status;
+    record.move = entry->move_status == -1 ? 0 : entry->move_status == 0 ? 1 : 2;
+
+    scan_output_write(buffer, &record, sizeof(record));
+    scan_output_write(buffer, prefix, prefix_len);
+    scan_output_write(buffer, entry->name, name_len);
+    scan_output_end(buffer);
+}
+
+struct scan_action_messages {
+    const char* doing;
+    const char* failed;
+    const char* exists;
+};
+
+// Indexed by scan_action (SCAN_ACTION_NONE never has a move_status)
+const struct scan_action_messages scan_action_messages[] = {
+    { "Moving compatible PGP subkey", "Failed to move PGP key file", "Failed to move PGP key file (already in destination)" },
+    { "Linking compatible PGP subkey", "Failed to link PGP key file", "Failed to link PGP key file (already in destination)" },
+    { "Symlinking compatible PGP subkey", "Failed to symlink PGP key file", "Failed to symlink PGP key file (already in destination)" },
+    { "Extracting compatible PGP subkey", "Failed to extract PGP key file", "Failed to extract PGP key file (already in destination)" }
+};
+
+// The manifest line of a compatible key and how acting on it went
+void scan_report_match(const struct scan_config* config, struct scan_output* output, const struct scan_entry* entry)
+{
+    int verbose = !config->quiet;
+
+    // Every compatible key (whether or not acting on it worked) by its path relative to the source directory
+    // With nothing to match every key is listed, for merge to pick out the compatible ones later
+    if (output->manifest.data != NULL && (scan_entry_compatible(config, entry) || (!config->match && entry->extract_status == PGP_KEY_OK))) {
+        if (config->manifest_binary)
+            scan_output_binary_record(&output->manifest, entry);
+        else {
+            scan_output_rel_path(&output->manifest, entry);
+            if (config->manifest_timestamps) {
+                scan_output_write(&output->manifest, "\t", 1);
+                scan_output_uint(&output->manifest, entry->timestamp);
+            }
+            scan_output_write(&output->manifest, "\n", 1);
+            scan_output_end(&output->manifest);
+        }
+    }
+
+    if (config->output_format == SCAN_OUTPUT_BINARY)
+        return;
+
+    if (entry->move_status != -1) {
+        const struct scan_action_messages* messages = &scan_action_messages[config->action];
+
+        if (config->output_format == SCAN_OUTPUT_TEXT && verbose)
+            scan_output_line(&output->err, messages->doing, config, entry);
+        if (entry->move_status == SCAN_MOVE_EXISTS)
+            scan_output_line(&output->err, messages->exists, config, entry);
+        else if (entry->move_status != SCAN_MOVE_DONE)
+            scan_output_line(&output->err, messages->failed, config, entry);
+    }
+    else if (config->output_format == SCAN_OUTPUT_TEXT && verbose && scan_entry_compatible(config, entry))
+        scan_output_line(&output->err, "Compatible PGP subkey", config, entry);
+}
+
+// Errors are always reported (on stderr), --quiet leaves out everything else
+void scan_report_entry(const struct scan_config* config, struct scan_output* output, const struct scan_entry* entry)
+{
+    int verbose = !config->quiet;
+
+#ifdef SCAN_STATS
+    // Every entry passes through here exactly once, whichever thread processed it
+    scan_stats_count(SCAN_COUNTER_ENTRIES);
+    if (entry->status == SCAN_SKIPPED)
+        scan_stats_count(SCAN_COUNTER_SKIPPED);
+    else if (entry->status == SCAN_STAT_FAILED)
+        scan_stats_count(SCAN_COUNTER_STAT_FAILED);
+    else if (entry->extract_status != PGP_KEY_OK)
+        scan_stats_count(SCAN_COUNTER_FAILED);
+    else {
+        scan_stats_count(SCAN_COUNTER_EXTRACTED);
+        if (entry->indexed)
+            scan_stats_count(SCAN_COUNTER_INDEXED);
+        if (entry->move_status != -1)
+            scan_stats_count(SCAN_COUNTER_MATCHED);
+        if (entry->move_status > 0)
+            scan_stats_count(SCAN_COUNTER_MOVE_FAILED);
+    }
+#endif
+
+    if (entry->status == SCAN_SKIPPED)
+        return;
+
+    if (entry->status == SCAN_STAT_FAILED) {
+        scan_output_line(&output->err, "Unable to stat file", config, entry);
+        return;
+    }
+
+    if (config->output_format == SCAN_OUTPUT_BINARY) {
+        if (verbose)
+            scan_output_binary_record(&output->out, entry);
+        scan_report_match(config, output, entry);
+        return;
+    }
+
+    if (config->output_format == SCAN_OUTPUT_TEXT && verbose)
+        scan_output_line(&output->err, "Opening", config, entry);
+    if (entry->extract_status != PGP_KEY_OK) {
+        scan_output_line(&output->err, pgp_key_strerror(entry->extract_status), config, entry);
+        return;
+    }
+
+    if (verbose) {
+        if (config->output_format == SCAN_OUTPUT_TSV) {
+            scan_output_path(&output->out, config, entry);
+            scan_output_write(&output->out, "\t", 1);
+        }
+        else
+            scan_output_str(&output->out, "Timestamp: ");
+        scan_output_uint(&output->out, entry->timestamp);
+        scan_output_write(&output->out, "\n", 1);
+        scan_output_end(&output->out);
+    }
+
+    scan_report_match(config, output, entry);
+}
+
+#ifdef HAVE_IO_URING
+// io_uring backend
+//
+// Every file in a batch gets a linked SQE chain relative to the source directory fd:
+//   [statx ->] openat (into a fixed file slot) -> read (first PGP_KEY_HEADER_SIZE bytes) -> close
+// The statx is only needed for symlinks and entries without a d_type
+// (with a timestamp index every file is statx'ed in a pass of its own first and only index misses get a chain)
+// The read is hard-linked to the close so the slot is released even if the read fails (e.g. EISDIR)
+// The whole batch goes in with one io_uring_enter call that also waits for every completion
+// Compatible keys are then moved (or hard linked) with one renameat (linkat) SQE each in a second submission
+// The ring is driven with raw syscalls so there's no liburing dependency
+
+enum scan_uring_op {
+    SCAN_URING_STATX,
+    SCAN_URING_OPENAT,
+    SCAN_URING_READ,
+    SCAN_URING_CLOSE,
+    // renameat or linkat
+    SCAN_URING_ACTION
+};
+
+enum {
+    SCAN_URING_OPS = 5
+};
+
+struct scan_uring {
+    int fd;
+    unsigned int entries;
+
+    void* sq_ring;
+    size_t sq_ring_len;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned int sq_local_tail;
+    unsigned int sq_pending;
+
+    void* cq_ring;
+    size_t cq_ring_len;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Per file in the batch
+    unsigned char* bufs;
+    struct statx* stx;
+    int (*res)[SCAN_URING_OPS];
+};
+
+int scan_uring_setup_syscall(unsigned int entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int scan_uring_enter_syscall(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int scan_uring_register_syscall(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void scan_uring_destroy(struct scan_uring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+// Returns 0 on success or 1 if io_uring (or one of the operations or features we rely on) isn't available
+int scan_uring_init(struct scan_uring* ring, unsigned int files)
+{
+    static const unsigned char required_ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+    struct io_uring_params params;
+    struct io_uring_probe* probe;
+    size_t probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int* fds;
+    unsigned int i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = scan_uring_setup_syscall(files * 4, &params);
+    if (ring->fd < 0)
+        return 1;
+
+    // A single mmap for both rings (5.4) and direct descriptors for openat/close (5.15) are required
+    // IORING_FEAT_CQE_SKIP (5.17) is only used as a marker for a new enough kernel
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_CQE_SKIP)) {
+        scan_uring_destroy(ring);
+        return 1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_len > ring->sq_ring_len)
+        ring->sq_ring_len = ring->cq_ring_len;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        scan_uring_destroy(ring);
+        return 1;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        scan_uring_destroy(ring);
+        return 1;
+    }
+
+    ring->sq_head = (unsigned int*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    probe = scan_mem_calloc(1, probe_len);
+    if (probe == NULL) {
+        scan_uring_destroy(ring);
+        return 1;
+    }
+    if (scan_uring_register_syscall(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        scan_mem_free(probe);
+        scan_uring_destroy(ring);
+        return 1;
+    }
+    for (i = 0; i < sizeof(required_ops); i++) {
+        if (required_ops[i] > probe->last_op || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            scan_mem_free(probe);
+            scan_uring_destroy(ring);
+            return 1;
+        }
+    }
+    scan_mem_free(probe);
+
+    // Sparse fixed file table: slot i belongs to file i of the current batch
+    fds = scan_mem_alloc(files * sizeof(*fds));
+    if (fds == NULL) {
+        scan_uring_destroy(ring);
+        return 1;
+    }
+    for (i = 0; i < files; i++)
+        fds[i] = -1;
+    if (scan_uring_register_syscall(ring->fd, IORING_REGISTER_FILES, fds, files) < 0) {
+        scan_mem_free(fds);
+        scan_uring_destroy(ring);
+        return 1;
+    }
+    scan_mem_free(fds);
+
+    return 0;
+}
+
+// Arena space scan_uring_init_buffers takes
+size_t scan_uring_buffers_size(unsigned int files)
+{
+    return scan_arena_round((size_t)files * PGP_KEY_HEADER_SIZE) + scan_arena_round(files * sizeof(struct statx)) +
+           scan_arena_round(files * sizeof(int[SCAN_URING_OPS]));
+}
+
+// The buffers for each file in a batch (apart from scan_uring_init, which scan_uring_available uses too)
+int scan_uring_init_buffers(struct scan_uring* ring, unsigned int files, struct scan_arena* arena)
+{
+    ring->bufs = scan_arena_alloc(arena, (size_t)files * PGP_KEY_HEADER_SIZE);
+    ring->stx = scan_arena_alloc(arena, files * sizeof(*ring->stx));
+    ring->res = scan_arena_alloc(arena, files * sizeof(*ring->res));
+    if (ring->bufs == NULL || ring->stx == NULL || ring->res == NULL) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int scan_uring_available(void)
+{
+    struct scan_uring ring;
+
+    if (scan_uring_init(&ring, 1) != 0)
+        return 0;
+    scan_uring_destroy(&ring);
+    return 1;
+}
+
+// Queue an SQE for one of the files in the current batch (user_data encodes the file index and which step it is)
+struct io_uring_sqe* scan_uring_get_sqe(struct scan_uring* ring, unsigned int file, int op, unsigned char opcode, unsigned char flags)
+{
+    unsigned int index = ring->sq_local_tail++ & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->user_data = (unsigned long long)file * SCAN_URING_OPS + op;
+    ring->sq_array[index] = index;
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+// Submit everything queued and wait until expected completions have been reaped into ring->res
+int scan_uring_run(struct scan_uring* ring, unsigned int expected)
+{
+    unsigned int reaped = 0;
+    int ret;
+    SCAN_STATS_TIME(start);
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            ring->res[cqe->user_data / SCAN_URING_OPS][cqe->user_data % SCAN_URING_OPS] = cqe->res;
+            reaped++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (reaped >= expected) {
+            SCAN_STATS_STAGE(SCAN_STAGE_URING, start);
+            return 0;
+        }
+
+        ret = scan_uring_enter_syscall(ring->fd, ring->sq_pending, expected - reaped, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        ring->sq_pending -= ret;
+    }
+}
+#endif
+
+// Window into the ring of entries owned by the parallel scan (see below)
+struct scan_slot {
+    struct scan_entry entry;
+    char name[NAME_MAX + 1];
+    int done;
+    // getdents64 offset of the entry (see Checkpoints)
+    int64_t cookie;
+};
+
+struct scan_batch {
+    struct scan_slot* slots;
+    size_t mask;
+    size_t first;
+    size_t count;
+};
+
+struct scan_entry* scan_batch_entry(const struct scan_batch* batch, size_t i)
+{
+    return &batch->slots[(batch->first + i) & batch->mask].entry;
+}
+
+#ifdef HAVE_IO_URING
+void scan_uring_statx(const struct scan_config* config, struct scan_uring* ring, unsigned int i, const struct scan_entry* entry, unsigned char flags)
+{
+    struct io_uring_sqe* sqe = scan_uring_get_sqe(ring, i, SCAN_URING_STATX, IORING_OP_STATX, flags);
+
+    sqe->fd = scan_entry_dirfd(config, entry);
+    sqe->addr = (unsigned long)entry->name;
+    sqe->len = STATX_TYPE | STATX_SIZE | (config->index != NULL ? STATX_INO | STATX_MTIME : 0);
+    sqe->off = (unsigned long)&ring->stx[i];
+}
+
+// Returns 0 unless the statx result means the entry is done with
+int scan_uring_statx_result(const struct scan_config* config, struct scan_uring* ring, unsigned int i, struct scan_entry* entry)
+{
+    const struct statx* stx = &ring->stx[i];
+
+    if (ring->res[i][SCAN_URING_STATX] < 0) {
+        entry->status = SCAN_STAT_FAILED;
+        return 1;
+    }
+
+    scan_entry_stat(config, entry, S_ISDIR(stx->stx_mode), stx->stx_ino, stx->stx_size,
+                    (int64_t)stx->stx_mtime.tv_sec * 1000000000 + stx->stx_mtime.tv_nsec);
+    return entry->status != SCAN_PENDING;
+}
+
+// With an index every file is stat'ed in a pass of its own first so index hits are never opened
+// Without one, this just says what the directory entry tells us
+int scan_uring_entry_kind(const struct scan_config* config, const struct scan_entry* entry)
+{
+    if (config->index == NULL)
+        return scan_entry_kind(entry);
+
+    return entry->status == SCAN_PENDING ? SCAN_KIND_FILE : SCAN_KIND_SKIP;
+}
+
+// Returns 1 if io_uring failed before the batch was extracted so it needs to go through the sync path instead
+int scan_uring_process_batch(const struct scan_config* config, struct scan_uring* ring, struct scan_buffers* buffers, const struct scan_batch* batch)
+{
+    unsigned int expected = 0;
+    unsigned int actions = 0;
+    unsigned int sqes = 0;
+    size_t i;
+
+    for (i = 0; i < batch->count; i++)
+        scan_entry_reset(scan_batch_entry(batch, i));
+
+    if (config->index != NULL) {
+        for (i = 0; i < batch->count; i++) {
+            struct scan_entry* entry = scan_batch_entry(batch, i);
+
+            if (scan_entry_kind(entry) == SCAN_KIND_SKIP)
+                continue;
+
+            scan_uring_statx(config, ring, i, entry, 0);
+            expected++;
+        }
+
+        if (scan_uring_run(ring, expected) != 0)
+            return 1;
+
+        for (i = 0; i < batch->count; i++) {
+            struct scan_entry* entry = scan_batch_entry(batch, i);
+
+            if (scan_entry_kind(entry) != SCAN_KIND_SKIP)
+                scan_uring_statx_result(config, ring, i, entry);
+        }
+        expected = 0;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        struct scan_entry* entry = scan_batch_entry(batch, i);
+        struct io_uring_sqe* sqe;
+
+        int kind = scan_uring_entry_kind(config, entry);
+
+        if (kind == SCAN_KIND_SKIP)
+            continue;
+
+        if (kind == SCAN_KIND_STAT) {
+            scan_uring_statx(config, ring, i, entry, IOSQE_IO_LINK);
+            expected++;
+        }
+
+        // O_NONBLOCK so a FIFO in the source directory can't stall the ring (no effect on regular files)
+        sqe = scan_uring_get_sqe(ring, i, SCAN_URING_OPENAT, IORING_OP_OPENAT, IOSQE_IO_LINK);
+        sqe->fd = scan_entry_dirfd(config, entry);
+        sqe->addr = (unsigned long)entry->name;
+        sqe->open_flags = O_RDONLY | O_NONBLOCK | (atomic_load_explicit(&pgp_key_open_noatime, memory_order_relaxed) ? O_NOATIME : 0);
+        sqe->file_index = i + 1;
+
+        sqe = scan_uring_get_sqe(ring, i, SCAN_URING_READ, IORING_OP_READ, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+        sqe->fd = i;
+        sqe->addr = (unsigned long)(ring->bufs + i * PGP_KEY_HEADER_SIZE);
+        sqe->len = PGP_KEY_HEADER_SIZE;
+
+        sqe = scan_uring_get_sqe(ring, i, SCAN_URING_CLOSE, IORING_OP_CLOSE, 0);
+        sqe->file_index = i + 1;
+
+        expected += 3;
+    }
+
+    if (expected > 0 && scan_uring_run(ring, expected) != 0)
+        return 1;
+
+    for (i = 0; i < batch->count; i++) {
+        struct scan_entry* entry = scan_batch_entry(batch, i);
+        int* res = ring->res[i];
+        int kind = scan_uring_entry_kind(config, entry);
+
+        if (kind == SCAN_KIND_SKIP)
+            continue;
+
+        if (kind == SCAN_KIND_STAT && scan_uring_statx_result(config, ring, i, entry) != 0)
+            continue;
+
+        // O_NOATIME isn't allowed on files we don't own so let the sync path retry without it
+        if (res[SCAN_URING_OPENAT] == -EPERM)
+            entry->extract_status = pgp_key_extract_timestamp(scan_entry_dirfd(config, entry), entry->name, buffers->key, &entry->timestamp);
+        else if (res[SCAN_URING_OPENAT] < 0)
+            entry->extract_status = PGP_KEY_ERR_OPEN;
+        else if (res[SCAN_URING_READ] < 0)
+            entry->extract_status = PGP_KEY_ERR_READ;
+        else {
+            entry->extract_status = pgp_key_extract_timestamp_buf(ring->bufs + i * PGP_KEY_HEADER_SIZE, res[SCAN_URING_READ], &entry->timestamp);
+
+            // Rare long armor headers are finished off synchronously
+            if (entry->extract_status == PGP_KEY_ERR_ARMOR && res[SCAN_URING_READ] == PGP_KEY_HEADER_SIZE)
+                entry->extract_status = pgp_key_extract_timestamp(scan_entry_dirfd(config, entry), entry->name, buffers->key, &entry->timestamp);
+        }
+
+        // Skip empty files (a zero byte read)
+        if (entry->extract_status == PGP_KEY_ERR_EMPTY) {
+            entry->status = SCAN_SKIPPED;
+            continue;
+        }
+        entry->status = SCAN_EXTRACTED;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        struct scan_entry* entry = scan_batch_entry(batch, i);
+
+        struct io_uring_sqe* sqe;
+
+        if (entry->status != SCAN_EXTRACTED)
+            continue;
+        scan_select_entry(config, buffers, entry);
+        if (!scan_entry_acts_now(config, entry))
+            continue;
+
+        // Positive so we can tell if the action never completed
+        ring->res[i][SCAN_URING_ACTION] = 1;
+        actions++;
+
+        // Symlinks need a target path built for each of them so they're left to the synchronous path
+        if (config->action != SCAN_ACTION_SYMLINK) {
+            sqe = scan_uring_get_sqe(ring, i, SCAN_URING_ACTION, config->action == SCAN_ACTION_MOVE ? IORING_OP_RENAMEAT : IORING_OP_LINKAT, 0);
+            sqe->fd = scan_entry_dirfd(config, entry);
+            sqe->addr = (unsigned long)entry->name;
+            sqe->len = scan_entry_dest_dirfd(config, entry);
+            sqe->addr2 = (unsigned long)scan_entry_dest_name(entry);
+            // The same field as hardlink_flags (which stay 0)
+            sqe->rename_flags = config->action == SCAN_ACTION_MOVE ? RENAME_NOREPLACE : 0;
+            sqes++;
+        }
+    }
+
+    if (actions == 0)
+        return 0;
+
+    // Whatever io_uring didn't get to is done synchronously
+    if (sqes > 0)
+        scan_uring_run(ring, sqes);
+    for (i = 0; i < batch->count; i++) {
+        struct scan_entry* entry = scan_batch_entry(batch, i);
+        int* res = ring->res[i];
+
+        if (entry->status != SCAN_EXTRACTED || !scan_entry_acts_now(config, entry))
+            continue;
+
+        SCAN_STATS_TIME(start);
+        if (res[SCAN_URING_ACTION] > 0)
+            scan_act_entry(config, buffers, entry);
+        else
+            scan_act_entry_result(config, buffers, entry, -res[SCAN_URING_ACTION]);
+        SCAN_STATS_STAGE(SCAN_STAGE_RENAME, start);
+    }
+
+    return 0;
+}
+#endif
+
+// Tuning
+//
+// With -j auto the number of workers in use (and with --prefetch, the prefetch depth) is tuned while scanning, as the
+// best values depend on the storage: local NVMe keeps getting faster with more keys in flight, a single disk wants
+// few and NFS wants many opens outstanding. Every worker up to the limit is started and those past the number in
+// use are parked. Every half second the tuner samples the rate the workers get through keys at (and the time a
+// worker spends on each one, which is mostly waiting for the storage). The rate at some settings is the average of
+// two samples, after skipping the one in which they changed as batches from before are still in flight. It
+// hill-climbs one setting at a time: a step is kept if the rate goes up by more than the noise, otherwise it's
+// undone and the other direction is tried with half the step. A setting is settled once the smallest step has lost
+// both ways, and a settled scan starts over when the rate stays more than a third away from where it settled (e.g.
+// once it's past the keys that were in the page cache)
+// The settings are printed at the end so they can be pinned on that host with -j and --prefetch
+
+#define SCAN_TUNE_INTERVAL_NS 500000000
+// Samples averaged for each measurement
+#define SCAN_TUNE_SAMPLES 2
+// Share of the rate a step has to gain to be kept
+#define SCAN_TUNE_GAIN 0.05
+// Share of the rate a settled scan has to move by (this many measurements in a row) to start over
+#define SCAN_TUNE_DRIFT 0.33
+#define SCAN_TUNE_DRIFTS 3
+// Up to this many workers per CPU, within the bounds
+#define SCAN_TUNE_JOBS_PER_CPU 8
+#define SCAN_TUNE_MIN_MAX_JOBS 16
+#define SCAN_TUNE_MAX_JOBS 64
+
+enum scan_tune_setting {
+    SCAN_TUNE_JOBS,
+    SCAN_TUNE_PREFETCH,
+    SCAN_TUNE_SETTINGS,
+    // Every setting has settled
+    SCAN_TUNE_SETTLED = SCAN_TUNE_SETTINGS
+};
+
+struct scan_tune_knob {
+    // The value kept so far
+    size_t value;
+    size_t min;
+    size_t max;
+    size_t min_step;
+    size_t step;
+    int direction;
+    // Smallest steps lost in a row
+    int misses;
+};
+
+struct scan_tune {
+    struct scan_tune_knob knobs[SCAN_TUNE_SETTINGS];
+    // enum scan_tune_setting being tuned
+    int setting;
+    // Files/s with every knob at its value (0 until measured)
+    double rate;
+    // A step is being tried: the setting is at trial instead of its value
+    int trying;
+    size_t trial;
+    // Measurements once settled that were too far from the rate
+    int drifts;
+    // The next sample is skipped (the settings just changed)
+    int skip;
+    double sum;
+    int samples;
+    // Last sample
+    double sample_rate;
+    double key_ns;
+};
+
+static inline uint64_t scan_tune_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void scan_tune_knob_init(struct scan_tune_knob* knob, size_t value, size_t min, size_t max, size_t min_step)
+{
+    knob->value = value;
+    knob->min = min;
+    knob->max = max;
+    knob->min_step = min_step;
+    knob->step = value / 2 > min_step ? value / 2 : min_step;
+    knob->direction = 1;
+    knob->misses = 0;
+}
+
+// Move on to the next setting that can change
+void scan_tune_next_setting(struct scan_tune* tune)
+{
+    do
+        tune->setting++;
+    while (tune->setting < SCAN_TUNE_SETTLED && tune->knobs[tune->setting].min == tune->knobs[tune->setting].max);
+    tune->rate = 0;
+}
+
+// Start at one worker per CPU (at least 2, so there's a step down to try) and the --prefetch depth
+// config->jobs and config->prefetch become the most the tuner goes up to, which the pool is sized for
+void scan_tune_init(struct scan_tune* tune, struct scan_config* config)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_jobs = (cpus > 0 ? (size_t)cpus : 1) * SCAN_TUNE_JOBS_PER_CPU;
+    size_t jobs = cpus > 2 ? (size_t)cpus : 2;
+    size_t prefetch = config->prefetch;
+
+    if (max_jobs < SCAN_TUNE_MIN_MAX_JOBS)
+        max_jobs = SCAN_TUNE_MIN_MAX_JOBS;
+    if (max_jobs > SCAN_TUNE_MAX_JOBS)
+        max_jobs = SCAN_TUNE_MAX_JOBS;
+    if (jobs > max_jobs)
+        jobs = max_jobs;
+
+    memset(tune, 0, sizeof(*tune));
+    scan_tune_knob_init(&tune->knobs[SCAN_TUNE_JOBS], jobs, 1, max_jobs, 1);
+    // Anywhere from a quarter to 4 times the depth asked for
+    if (prefetch > 0)
+        scan_tune_knob_init(&tune->knobs[SCAN_TUNE_PREFETCH], prefetch, (prefetch + 3) / 4,
+                            4 * prefetch < SCAN_PREFETCH_MAX_DEPTH ? 4 * prefetch : SCAN_PREFETCH_MAX_DEPTH, (prefetch + 7) / 8);
+    tune->setting = -1;
+    scan_tune_next_setting(tune);
+
+    config->jobs = max_jobs;
+    config->prefetch = tune->knobs[SCAN_TUNE_PREFETCH].max;
+}
+
+// Value of a setting right now
+size_t scan_tune_value(const struct scan_tune* tune, int setting)
+{
+    return tune->trying && tune->setting == setting ? tune->trial : tune->knobs[setting].value;
+}
+
+// Try the next step of the setting being tuned
+void scan_tune_propose(struct scan_tune* tune)
+{
+    struct scan_tune_knob* knob = &tune->knobs[tune->setting];
+    int tries;
+
+    // Turn around at a bound
+    for (tries = 0; tries < 2; tries++) {
+        if (knob->direction > 0)
+            tune->trial = knob->max - knob->value > knob->step ? knob->value + knob->step : knob->max;
+        else
+            tune->trial = knob->value - knob->min > knob->step ? knob->value - knob->step : knob->min;
+        if (tune->trial != knob->value)
+            break;
+        knob->direction = -knob->direction;
+    }
+    tune->trying = 1;
+}
+
+// One measurement of the rate at the current settings, which may change them
+void scan_tune_step(struct scan_tune* tune, double rate)
+{
+    struct scan_tune_knob* knob;
+
+    if (tune->setting == SCAN_TUNE_SETTLED) {
+        if (tune->rate == 0)
+            tune->rate = rate;
+        if (rate > tune->rate * (1 - SCAN_TUNE_DRIFT) && rate < tune->rate * (1 + SCAN_TUNE_DRIFT)) {
+            tune->drifts = 0;
+            return;
+        }
+        if (++tune->drifts < SCAN_TUNE_DRIFTS)
+            return;
+        tune->drifts = 0;
+
+        // Something changed underneath so search again from where the settings are
+        for (knob = tune->knobs; knob < tune->knobs + SCAN_TUNE_SETTINGS; knob++)
+            scan_tune_knob_init(knob, knob->value, knob->min, knob->max, knob->min_step);
+        tune->setting = -1;
+        scan_tune_next_setting(tune);
+        if (tune->setting == SCAN_TUNE_SETTLED)
+            return;
+    }
+    knob = &tune->knobs[tune->setting];
+
+    if (tune->trying) {
+        tune->trying = 0;
+        if (rate <= tune->rate * (1 + SCAN_TUNE_GAIN)) {
+            // Undone, the rate without the step is measured again before the next one
+            knob->direction = -knob->direction;
+            if (knob->step / 2 >= knob->min_step)
+                knob->step /= 2;
+            else if (++knob->misses == 2)
+                scan_tune_next_setting(tune);
+            tune->rate = 0;
+            return;
+        }
+
+        // Kept, and the next step is bigger
+        knob->value = tune->trial;
+        knob->misses = 0;
+        if (knob->step <= (knob->max - knob->min) / 2)
+            knob->step *= 2;
+    }
+    tune->rate = rate;
+    scan_tune_propose(tune);
+}
+
+// One sample of the rate
+void scan_tune_sample(struct scan_tune* tune, double rate)
+{
+    size_t jobs = scan_tune_value(tune, SCAN_TUNE_JOBS);
+    size_t prefetch = scan_tune_value(tune, SCAN_TUNE_PREFETCH);
+
+    if (tune->skip) {
+        tune->skip = 0;
+        return;
+    }
+    tune->sum += rate;
+    if (++tune->samples < SCAN_TUNE_SAMPLES)
+        return;
+
+    scan_tune_step(tune, tune->sum / tune->samples);
+    tune->sum = 0;
+    tune->samples = 0;
+    tune->skip = scan_tune_value(tune, SCAN_TUNE_JOBS) != jobs || scan_tune_value(tune, SCAN_TUNE_PREFETCH) != prefetch;
+}
+
+// Parallel scan
+//
+// The main thread enumerates the source directory and deals batches of entries out round-robin to per-worker queues
+// Each worker pops from the front of its own queue and, once that runs dry, steals from the back of the other queues
+// Entries live in a ring indexed by sequence number (directory entry order) which doubles as the reorder buffer:
+// a slot is only recycled once every entry before it has been reported, so in ordered mode output matches the
+// single-threaded program line for line. In unordered mode entries are reported as soon as they're processed.
+// With one job there are no worker threads and the main thread processes each batch as soon as it's full.
+
+struct scan_queue {
+    pthread_mutex_t lock;
+    struct scan_queue_item {
+        size_t first;
+        size_t count;
+    }* items;
+    size_t head;
+    size_t tail;
+};
+
+struct scan_pool;
+
+struct scan_worker {
+    pthread_t thread;
+    struct scan_pool* pool;
+    unsigned int index;
+    struct scan_queue queue;
+    // Everything below is carved out of it
+    struct scan_arena arena;
+    struct scan_buffers buffers;
+    // Used in unordered mode
+    struct scan_output output;
+#ifdef HAVE_IO_URING
+    struct scan_uring uring;
+    int uring_ready;
+#endif
+    // Time spent on batches and the keys in them, sampled by the tuner (-j auto only)
+    atomic_uint_least64_t busy_ns;
+    atomic_size_t busy_keys;
+};
+
+struct scan_pool {
+    const struct scan_config* config;
+    // Slots, workers, output and directory buffer
+    struct scan_arena arena;
+
+    struct scan_slot* slots;
+    // Power of two so a sequence number maps to its slot with a mask
+    size_t slots_mask;
+    // Next sequence number handed out by the enumerator
+    size_t next_seq;
+    // First entry of the batch the enumerator is filling
+    size_t batch_first;
+    // First entry not yet handed to the workers (behind batch_first by up to the prefetch depth)
+    size_t dispatch_first;
+    // Oldest sequence number not yet reported (and recycled)
+    size_t next_report;
+    int reporting;
+    // Shared by whichever thread is reporting in ordered mode
+    struct scan_output output;
+    pthread_mutex_t slots_lock;
+    pthread_cond_t slots_free;
+
+    struct scan_worker* workers;
+    unsigned int workers_count;
+    unsigned int workers_started;
+    int threaded;
+    unsigned int next_worker;
+    // Batches pushed but not yet taken by a worker
+    atomic_size_t queued;
+    int enumeration_done;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_wake;
+    // Only the first active_workers take batches, the others wait for park_wake (see Tuning)
+    atomic_uint active_workers;
+    pthread_cond_t park_wake;
+    // Entries held back for the prefetch stage (config->prefetch unless tuned)
+    atomic_size_t prefetch_depth;
+
+    // Recursive scan state (NULL otherwise) and the directory being enumerated
+    struct scan_tree* tree;
+    struct scan_dir* current_dir;
+    // getdents64 buffer (and the records sorted by inode with --inode-order)
+    char* dir_buf;
+    const struct linux_dirent64** dir_records;
+    // getdents64 offset of the entry being added
+    int64_t cookie;
+    // A resumed scan lists some directories again for only their subdirectories or only their keys
+    int skip_files;
+    int skip_subdirs;
+
+    pthread_t progress_thread;
+    int progress_started;
+    int progress_stop;
+    pthread_mutex_t progress_lock;
+    pthread_cond_t progress_wake;
+
+    pthread_t tune_thread;
+    int tune_started;
+    int tune_stop;
+    pthread_mutex_t tune_lock;
+    pthread_cond_t tune_wake;
+
+    // Prefetch stage (see scan_prefetch_main), everything from dispatch_first up to prefetch_end is its to look at
+    pthread_t prefetch_thread;
+    int prefetch_started;
+    int prefetch_stop;
+    size_t prefetch_next;
+    size_t prefetch_end;
+    pthread_mutex_t prefetch_lock;
+    pthread_cond_t prefetch_wake;
+};
+
+struct scan_tree;
+int scan_tree_add_subdir(struct scan_pool* pool, const char* name, unsigned char d_type);
+
+// Checkpoints
+//
+// A scan with --checkpoint=FILE records every so often how far it has got, so that when it's killed (or the node is
+// drained) --resume can carry on from there instead of opening every key again. Entries are retired strictly in
+// sequence order, so once an entry is retired every entry before it has been processed and reported: its getdents64
+// offset (d_off) and directory are the position. Those offsets are cookies that stay valid when the directory is
+// opened again and other entries are removed (hashes on ext4, XFS and Btrfs), so the resumed scan seeks straight to
+// the position. With -r, the directories on the way down to it are listed again for their subdirectories only
+// (the walk is depth first in listing order, so whichever subdirectories come before the one it's in were walked),
+// and the directory it's in for both its subdirectories and the keys after the position
+// The file is a log in native byte order (like the index, it's only for this machine): a header saying which scan
+// it's for, then a record for each checkpoint, appended and fdatasync'ed together with the manifest. A record has
+// the position, the number of files processed, the size of the manifest (which a resumed scan truncates back to)
+// and the index records added since the previous checkpoint, as the index itself is only written at the end of
+// the scan. A record torn by a kill in the middle of writing it fails its checksum and is dropped
+// Keys are only acted on as they're retired, and the actions of each round of retiring are logged first (in a record
+// of their own, fdatasync'ed before any of them is done). A key moved after the last checkpoint is gone from the
+// source directory, so the resumed scan wouldn't see it again: it's reported from the log instead, in the place it
+// has in the scan (see scan_checkpoint_replay)
+// The checkpoint file is removed once the scan has finished
+
+#define SCAN_CHECKPOINT_MAGIC "PGPCKPT2"
+#define SCAN_CHECKPOINT_INTERVAL 100000
+#define SCAN_CHECKPOINT_MAX_INTERVAL 100000000
+
+struct scan_checkpoint_header {
+    char magic[8];
+    // The source directory and options the checkpoints are for
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t shard_index;
+    uint32_t shard_count;
+    uint32_t recursive;
+    uint32_t indexed;
+};
+
+enum scan_checkpoint_kind {
+    SCAN_CHECKPOINT_POSITION,
+    // About to act on the keys in the names: for each a big endian timestamp then its path (relative to the source
+    // directory and NUL terminated), nothing else is set
+    SCAN_CHECKPOINT_ACTIONS
+};
+
+// Followed by prefix_len bytes of directory, records index records and names_size bytes of their names
+struct scan_checkpoint_record {
+    // FNV-1a of everything after it up to the end of the names
+    uint64_t checksum;
+    uint64_t files;
+    int64_t cookie;
+    // UINT64_MAX if the manifest isn't a regular file (or there's no manifest)
+    uint64_t manifest_size;
+    // Offset of the first name in the new index's names (what the records' names are relative to)
+    uint64_t names_base;
+    uint64_t names_size;
+    uint32_t records;
+    uint32_t prefix_len;
+    // enum scan_checkpoint_kind
+    uint32_t kind;
+    uint32_t actions;
+};
+
+struct scan_checkpoint {
+    int fd;
+    const char* path;
+    size_t interval;
+    // Entries retired since the last checkpoint
+    size_t since;
+    // Files processed before this run
+    uint64_t files_before;
+    // Index records already in the log
+    size_t logged_records;
+    size_t logged_names;
+    // Entries whose actions are in the log (a struct scan_pool next_report)
+    size_t logged_actions;
+    // The record being logged
+    char* log;
+    size_t log_capacity;
+    int failed;
+
+    // --resume with a checkpoint: where the scan picks up (resuming is cleared once the enumeration gets there)
+    int resuming;
+    char* resume_prefix;
+    int64_t resume_cookie;
+    uint64_t resume_manifest_size;
+    // The actions logged after that checkpoint, in the format of their records' names
+    char* replay;
+    size_t replay_size;
+    size_t replay_count;
+};
+
+void scan_checkpoint_header_init(struct scan_checkpoint_header* header, const struct scan_config* config, const struct stat* stbuf)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SCAN_CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->dev = stbuf->st_dev;
+    header->ino = stbuf->st_ino;
+    header->shard_index = config->shard_index;
+    header->shard_count = config->shard_count;
+    header->recursive = config->recursive;
+    header->indexed = config->index != NULL;
+}
+
+uint64_t scan_checkpoint_checksum(const struct scan_checkpoint_record* record, const char* prefix,
+                                  const void* records, const char* names)
+{
+    uint64_t hash = scan_fnv1a(SCAN_FNV1A_BASIS, (const char*)record + sizeof(record->checksum), sizeof(*record) - sizeof(record->checksum));
+
+    hash = scan_fnv1a(hash, prefix, record->prefix_len);
+    hash = scan_fnv1a(hash, records, (size_t)record->records * sizeof(struct scan_index_record));
+    return scan_fnv1a(hash, names, record->names_size);
+}
+
+// Read the log of a previous run: the last intact record is where the scan picks up, the index records of all of
+// them go into the new index. Returns the size of the log up to the end of the last intact record (0 on error)
+size_t scan_checkpoint_load(struct scan_checkpoint* checkpoint, const struct scan_config* config, const char* buf, size_t size)
+{
+    const struct scan_checkpoint_header* header = (const struct scan_checkpoint_header*)buf;
+    struct scan_checkpoint_header expected;
+    struct scan_checkpoint_record record;
+    struct stat stbuf;
+    size_t pos = sizeof(*header);
+    size_t end = pos;
+    uint32_t i;
+
+    if (size < sizeof(*header) || memcmp(header->magic, SCAN_CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Not a checkpoint: %s\n", checkpoint->path);
+        return 0;
+    }
+    if (fstat(config->source_dirfd, &stbuf) == -1) {
+        fprintf(stderr, "Can't stat directory %s\n", config->source_dir);
+        return 0;
+    }
+    scan_checkpoint_header_init(&expected, config, &stbuf);
+    if (memcmp(header, &expected, sizeof(expected)) != 0) {
+        fprintf(stderr, "Checkpoint %s is for another source directory or other options (-r, --index or --shard)\n", checkpoint->path);
+        return 0;
+    }
+
+    while (size - pos >= sizeof(record)) {
+        const char* prefix = buf + pos + sizeof(record);
+        const char* records;
+        const char* names;
+
+        memcpy(&record, buf + pos, sizeof(record));
+        if (record.prefix_len > PATH_MAX || record.prefix_len > size - pos - sizeof(record) ||
+            record.records > (size - pos - sizeof(record) - record.prefix_len) / sizeof(struct scan_index_record))
+            break;
+        records = prefix + record.prefix_len;
+        names = records + (size_t)record.records * sizeof(struct scan_index_record);
+        if (record.names_size > size - (names - buf) ||
+            (record.names_size > 0 && names[record.names_size - 1] != '\0') ||
+            scan_checkpoint_checksum(&record, prefix, records, names) != record.checksum)
+            break;
+        pos = end = names + record.names_size - buf;
+
+        if (record.kind == SCAN_CHECKPOINT_ACTIONS) {
+            char* replay = scan_mem_realloc(checkpoint->replay, checkpoint->replay_size + record.names_size);
+
+            if (replay == NULL) {
+                fprintf(stderr, "Failed to allocate checkpoint\n");
+                return 0;
+            }
+            memcpy(replay + checkpoint->replay_size, names, record.names_size);
+            checkpoint->replay = replay;
+            checkpoint->replay_size += record.names_size;
+            checkpoint->replay_count += record.actions;
+            continue;
+        }
+        // Those were all done before this checkpoint
+        checkpoint->replay_size = 0;
+        checkpoint->replay_count = 0;
+
+        scan_mem_free(checkpoint->resume_prefix);
+        if ((checkpoint->resume_prefix = scan_mem_alloc(record.prefix_len + 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate checkpoint\n");
+            return 0;
+        }
+        memcpy(checkpoint->resume_prefix, prefix, record.prefix_len);
+        checkpoint->resume_prefix[record.prefix_len] = '\0';
+        checkpoint->resume_cookie = record.cookie;
+        checkpoint->resume_manifest_size = record.manifest_size;
+        checkpoint->files_before = record.files;
+        checkpoint->resuming = 1;
+
+        for (i = 0; i < record.records && config->index != NULL; i++) {
+            struct scan_index_record index_record;
+
+            memcpy(&index_record, records + (size_t)i * sizeof(index_record), sizeof(index_record));
+            if (index_record.name < record.names_base || index_record.name - record.names_base >= record.names_size)
+                continue;
+            scan_index_add_record(config->index, &index_record, names + (index_record.name - record.names_base));
+            // The records weren't looked up this run, so the index has to be written out with them
+            config->index->misses++;
+        }
+    }
+
+    // They're all in the log already
+    if (config->index != NULL) {
+        checkpoint->logged_records = config->index->new_count;
+        checkpoint->logged_names = config->index->new_names_size;
+    }
+    return end;
+}
+
+// Start a new log, or with resume carry on with the one a previous run left (if there is one)
+int scan_checkpoint_open(struct scan_checkpoint* checkpoint, const struct scan_config* config, const char* path, int resume)
+{
+    struct scan_checkpoint_header header;
+    struct stat stbuf;
+    char* buf;
+    size_t len = 0;
+    size_t end;
+    ssize_t ret;
+
+    checkpoint->path = path;
+    checkpoint->fd = -1;
+    checkpoint->resume_manifest_size = UINT64_MAX;
+
+    if (resume && (checkpoint->fd = open(path, O_RDWR | O_CLOEXEC)) != -1) {
+        if (fstat(checkpoint->fd, &stbuf) == -1 || (buf = scan_mem_alloc((size_t)stbuf.st_size + 1)) == NULL) {
+            fprintf(stderr, "Can't read checkpoint %s\n", path);
+            return 1;
+        }
+        while (len < (size_t)stbuf.st_size && (ret = read(checkpoint->fd, buf + len, stbuf.st_size - len)) != 0) {
+            if (ret == -1) {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Can't read checkpoint %s\n", path);
+                scan_mem_free(buf);
+                return 1;
+            }
+            len += ret;
+        }
+        end = scan_checkpoint_load(checkpoint, config, buf, len);
+        scan_mem_free(buf);
+        // Anything after the last intact record is dropped so appending carries on from there
+        if (end == 0 || ftruncate(checkpoint->fd, end) == -1 || lseek(checkpoint->fd, 0, SEEK_END) == -1) {
+            if (end != 0)
+                fprintf(stderr, "Can't write checkpoint %s\n", path);
+            return 1;
+        }
+        if (!checkpoint->resuming || config->quiet)
+            return 0;
+        fprintf(stderr, "Resuming from checkpoint %s (%llu files already processed)\n", path, (unsigned long long)checkpoint->files_before);
+        return 0;
+    }
+    if (resume && errno != ENOENT) {
+        fprintf(stderr, "Can't open checkpoint %s\n", path);
+        return 1;
+    }
+
+    if ((checkpoint->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        fprintf(stderr, "Can't create checkpoint %s\n", path);
+        return 1;
+    }
+    if (fstat(config->source_dirfd, &stbuf) == -1) {
+        fprintf(stderr, "Can't stat directory %s\n", config->source_dir);
+        return 1;
+    }
+    scan_checkpoint_header_init(&header, config, &stbuf);
+    if (scan_index_write_all(checkpoint->fd, &header, sizeof(header)) != 0 || fdatasync(checkpoint->fd) == -1) {
+        fprintf(stderr, "Can't write checkpoint %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Add a record to the log (and wait for it to be on disk)
+int scan_checkpoint_append(const struct scan_checkpoint* checkpoint, struct scan_checkpoint_record* record, const char* prefix,
+                           const void* records, const char* names)
+{
+    record->checksum = scan_checkpoint_checksum(record, prefix, records, names);
+
+    if (scan_index_write_all(checkpoint->fd, record, sizeof(*record)) != 0 ||
+        scan_index_write_all(checkpoint->fd, prefix, record->prefix_len) != 0 ||
+        scan_index_write_all(checkpoint->fd, records, (size_t)record->records * sizeof(struct scan_index_record)) != 0 ||
+        scan_index_write_all(checkpoint->fd, names, record->names_size) != 0 ||
+        fdatasync(checkpoint->fd) == -1)
+        return 1;
+    return 0;
+}
+
+// Record that every entry up to and including slot's has been processed (called by the thread reporting it)
+void scan_checkpoint_write(struct scan_pool* pool, const struct scan_slot* slot)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_checkpoint* checkpoint = config->checkpoint;
+    struct scan_index* index = config->index;
+    const char* prefix = slot->entry.dir != NULL ? slot->entry.dir->prefix : "";
+    struct scan_checkpoint_record record;
+    const void* records = NULL;
+    const char* names = NULL;
+    struct stat stbuf;
+
+    checkpoint->since = 0;
+    if (checkpoint->failed)
+        return;
+
+    // What the checkpoint says is done has to be on disk first
+    scan_output_flush(&pool->output);
+    memset(&record, 0, sizeof(record));
+    record.manifest_size = UINT64_MAX;
+    if (config->manifest_fd != -1 && fstat(config->manifest_fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode)) {
+        if (fdatasync(config->manifest_fd) == -1)
+            goto fail;
+        record.manifest_size = stbuf.st_size;
+    }
+
+    record.files = checkpoint->files_before + pool->next_report + 1;
+    record.cookie = slot->cookie;
+    record.prefix_len = strlen(prefix);
+    // The new index isn't written if it ran out of memory so there's nothing to keep
+    if (index != NULL && !index->failed) {
+        records = index->new_records + checkpoint->logged_records;
+        record.records = index->new_count - checkpoint->logged_records;
+        names = index->new_names + checkpoint->logged_names;
+        record.names_base = checkpoint->logged_names;
+        record.names_size = index->new_names_size - checkpoint->logged_names;
+    }
+    if (scan_checkpoint_append(checkpoint, &record, prefix, records, names) != 0)
+        goto fail;
+
+    if (index != NULL && !index->failed) {
+        checkpoint->logged_records = index->new_count;
+        checkpoint->logged_names = index->new_names_size;
+    }
+    return;
+
+fail:
+    fprintf(stderr, "Failed to write checkpoint %s, no more checkpoints will be written\n", checkpoint->path);
+    checkpoint->failed = 1;
+}
+
+// Log the actions on the retired entries from first up to end before doing them (called by the thread reporting them)
+void scan_checkpoint_log_actions(struct scan_pool* pool, size_t first, size_t end)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_checkpoint* checkpoint = config->checkpoint;
+    struct scan_checkpoint_record record;
+    size_t i;
+
+    checkpoint->logged_actions = end;
+    if (checkpoint->failed)
+        return;
+
+    memset(&record, 0, sizeof(record));
+    record.kind = SCAN_CHECKPOINT_ACTIONS;
+    for (i = first; i != end; i++) {
+        const struct scan_entry* entry = &pool->slots[i & pool->slots_mask].entry;
+        const char* prefix = scan_entry_prefix(entry);
+        size_t prefix_len = strlen(prefix);
+        size_t name_len = strlen(entry->name) + 1;
+        uint32_t timestamp = htonl(entry->timestamp);
+
+        if (entry->status != SCAN_EXTRACTED || !scan_entry_wants_action(config, entry))
+            continue;
+
+        while (checkpoint->log_capacity - record.names_size < sizeof(timestamp) + prefix_len + name_len) {
+            size_t capacity = checkpoint->log_capacity ? checkpoint->log_capacity * 2 : 65536;
+            char* log = scan_mem_realloc(checkpoint->log, capacity);
+
+            if (log == NULL)
+                goto fail;
+            checkpoint->log = log;
+            checkpoint->log_capacity = capacity;
+        }
+        memcpy(checkpoint->log + record.names_size, &timestamp, sizeof(timestamp));
+        memcpy(checkpoint->log + record.names_size + sizeof(timestamp), prefix, prefix_len);
+        memcpy(checkpoint->log + record.names_size + sizeof(timestamp) + prefix_len, entry->name, name_len);
+        record.names_size += sizeof(timestamp) + prefix_len + name_len;
+        record.actions++;
+    }
+
+    if (record.actions == 0 || scan_checkpoint_append(checkpoint, &record, "", NULL, checkpoint->log) == 0)
+        return;
+
+fail:
+    fprintf(stderr, "Failed to write checkpoint %s, no more checkpoints will be written\n", checkpoint->path);
+    checkpoint->failed = 1;
+}
+
+// Logged actions by path, the first of the same path first
+int scan_checkpoint_replay_compare(const void* a, const void* b)
+{
+    const char* action_a = *(const char* const*)a;
+    const char* action_b = *(const char* const*)b;
+    int ret = strcmp(action_a + sizeof(uint32_t), action_b + sizeof(uint32_t));
+
+    if (ret != 0)
+        return ret;
+    return action_a < action_b ? -1 : action_a > action_b;
+}
+
+// Back in the order they were logged
+int scan_checkpoint_replay_order_compare(const void* a, const void* b)
+{
+    const char* action_a = *(const char* const*)a;
+    const char* action_b = *(const char* const*)b;
+
+    return action_a < action_b ? -1 : action_a > action_b;
+}
+
+// --resume: finish what the previous run was doing with the logged actions, before anything else is reported
+// A key that was moved is reported now, as the scan won't see it again. One that's still in the source directory is
+// left for the scan, and so is a key that was linked, after taking out the link the previous run may have made (so
+// it isn't in the way and the key is reported the same as if the scan had never stopped)
+// A path is in the log twice if the previous run was itself resumed, it's only replayed the first time
+int scan_checkpoint_replay(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_checkpoint* checkpoint = config->checkpoint;
+    char target[PATH_MAX];
+    char link_target[PATH_MAX];
+    char** actions;
+    size_t count = 0;
+    size_t replayed = 0;
+    size_t first = 0;
+    size_t pos;
+    size_t i;
+
+    if (checkpoint->replay_count == 0)
+        return 0;
+    if ((actions = scan_mem_alloc(checkpoint->replay_count * sizeof(*actions))) == NULL) {
+        fprintf(stderr, "Failed to allocate checkpoint\n");
+        return 1;
+    }
+    for (pos = 0; count < checkpoint->replay_count && pos < checkpoint->replay_size; count++) {
+        actions[count] = checkpoint->replay + pos;
+        pos += sizeof(uint32_t) + strlen(checkpoint->replay + pos + sizeof(uint32_t)) + 1;
+    }
+
+    // Repeats are left with an empty path
+    qsort(actions, count, sizeof(*actions), scan_checkpoint_replay_compare);
+    for (i = 1; i < count; i++) {
+        if (strcmp(actions[i] + sizeof(uint32_t), actions[first] + sizeof(uint32_t)) == 0)
+            actions[i][sizeof(uint32_t)] = '\0';
+        else
+            first = i;
+    }
+    qsort(actions, count, sizeof(*actions), scan_checkpoint_replay_order_compare);
+
+    for (i = 0; i < count; i++) {
+        const char* path = actions[i] + sizeof(uint32_t);
+        struct scan_entry entry = { 0 };
+        uint32_t timestamp;
+        struct stat src;
+        struct stat dst;
+        int dst_dirfd;
+        ssize_t len;
+
+        if (*path == '\0')
+            continue;
+        memcpy(&timestamp, actions[i], sizeof(timestamp));
+
+        // The path is relative to the source directory, and mirrored under the destination with -r
+        entry.name = path;
+        entry.d_type = DT_REG;
+        entry.status = SCAN_EXTRACTED;
+        entry.extract_status = PGP_KEY_OK;
+        entry.timestamp = ntohl(timestamp);
+        entry.move_status = -1;
+        if (!scan_entry_wants_action(config, &entry))
+            continue;
+        dst_dirfd = config->recursive ? config->dest_dirfd : scan_entry_dest_dirfd(config, &entry);
+        if (fstatat(dst_dirfd, path, &dst, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+
+        switch (config->action) {
+        case SCAN_ACTION_MOVE:
+            if (fstatat(config->source_dirfd, path, &src, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)
+                break;
+            entry.move_status = SCAN_MOVE_DONE;
+            scan_report_match(config, &pool->output, &entry);
+            replayed++;
+            break;
+        case SCAN_ACTION_LINK:
+            if (fstatat(config->source_dirfd, path, &src, AT_SYMLINK_NOFOLLOW) == 0 && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino)
+                unlinkat(dst_dirfd, path, 0);
+            break;
+        case SCAN_ACTION_SYMLINK:
+            if (snprintf(target, sizeof(target), "%s/%s", config->source_realpath, path) >= (int)sizeof(target))
+                break;
+            len = readlinkat(dst_dirfd, path, link_target, sizeof(link_target));
+            if (len == (ssize_t)strlen(target) && memcmp(link_target, target, len) == 0)
+                unlinkat(dst_dirfd, path, 0);
+            break;
+        }
+    }
+
+    scan_mem_free(actions);
+    // The scan won't see them to count them
+    checkpoint->files_before += replayed;
+    return 0;
+}
+
+// --resume: put the manifest back the way it was at the checkpoint (emptied if there's no checkpoint) and set
+// *out_size to its size (0 if it isn't a regular file, which just carries on)
+int scan_checkpoint_manifest(const struct scan_checkpoint* checkpoint, int fd, const char* path, uint64_t* out_size)
+{
+    uint64_t size = checkpoint->resuming ? checkpoint->resume_manifest_size : 0;
+    struct stat stbuf;
+
+    *out_size = 0;
+    if (fstat(fd, &stbuf) == -1) {
+        fprintf(stderr, "Can't stat manifest %s\n", path);
+        return 1;
+    }
+    if (!S_ISREG(stbuf.st_mode))
+        return 0;
+
+    // It wasn't a regular file when the checkpoint was written
+    if (size == UINT64_MAX)
+        size = stbuf.st_size;
+    if ((uint64_t)stbuf.st_size < size) {
+        fprintf(stderr, "Manifest %s is shorter than it was at the checkpoint\n", path);
+        return 1;
+    }
+    if (ftruncate(fd, size) == -1 || lseek(fd, 0, SEEK_END) == -1) {
+        fprintf(stderr, "Can't write manifest %s\n", path);
+        return 1;
+    }
+    *out_size = size;
+    return 0;
+}
+
+// The scan is over: nothing is left to resume (unless it didn't get to the end)
+int scan_checkpoint_close(struct scan_checkpoint* checkpoint, int finished)
+{
+    int ret = 0;
+
+    if (finished && unlink(checkpoint->path) == -1) {
+        fprintf(stderr, "Can't remove checkpoint %s\n", checkpoint->path);
+        ret = 1;
+    }
+    if (checkpoint->fd != -1)
+        close(checkpoint->fd);
+    scan_mem_free(checkpoint->resume_prefix);
+    scan_mem_free(checkpoint->replay);
+    scan_mem_free(checkpoint->log);
+    return ret;
+}
+
+// Queue capacity is the slot count because there can never be more batches in flight than slots
+void scan_queue_push(struct scan_queue* queue, size_t mask, size_t first, size_t count)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->items[queue->tail & mask].first = first;
+    queue->items[queue->tail & mask].count = count;
+    queue->tail++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int scan_queue_pop_front(struct scan_queue* queue, size_t mask, struct scan_queue_item* out_item)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head != queue->tail) {
+        *out_item = queue->items[queue->head++ & mask];
+        found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+int scan_queue_pop_back(struct scan_queue* queue, size_t mask, struct scan_queue_item* out_item)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head != queue->tail) {
+        *out_item = queue->items[--queue->tail & mask];
+        found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+// Blocks until a batch is available to this worker
+// Returns 0 once enumeration has finished and every queue is empty
+int scan_pool_take(struct scan_worker* worker, struct scan_queue_item* out_item)
+{
+    struct scan_pool* pool = worker->pool;
+    unsigned int i;
+
+    for (;;) {
+        if (scan_queue_pop_front(&worker->queue, pool->slots_mask, out_item))
+            break;
+
+        // Parked once its own queue is empty, the workers in use steal whatever else was dealt to it
+        if (worker->index >= atomic_load(&pool->active_workers)) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (worker->index >= atomic_load(&pool->active_workers) && !pool->enumeration_done)
+                pthread_cond_wait(&pool->park_wake, &pool->idle_lock);
+            if (worker->index >= atomic_load(&pool->active_workers)) {
+                pthread_mutex_unlock(&pool->idle_lock);
+                return 0;
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+
+        for (i = 1; i < pool->workers_count; i++) {
+            struct scan_worker* victim = &pool->workers[(worker->index + i) % pool->workers_count];
+            if (scan_queue_pop_back(&victim->queue, pool->slots_mask, out_item))
+                goto found;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (atomic_load(&pool->queued) == 0 && !pool->enumeration_done)
+            pthread_cond_wait(&pool->idle_wake, &pool->idle_lock);
+        if (atomic_load(&pool->queued) == 0 && pool->enumeration_done) {
+            pthread_mutex_unlock(&pool->idle_lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+found:
+    atomic_fetch_sub(&pool->queued, 1);
+    return 1;
+}
+
+void scan_worker_process_batch(struct scan_worker* worker, size_t first, size_t count)
+{
+    struct scan_pool* pool = worker->pool;
+    struct scan_batch batch = { pool->slots, pool->slots_mask, first, count };
+    size_t i;
+
+    // --first already has its keys so whatever is still queued is dropped unread
+    if (scan_select_done(pool->config)) {
+        for (i = 0; i < count; i++)
+            scan_entry_reset(scan_batch_entry(&batch, i));
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (worker->uring_ready) {
+        if (scan_uring_process_batch(pool->config, &worker->uring, &worker->buffers, &batch) == 0) {
+            scan_move_flush(&worker->buffers.mover);
+            return;
+        }
+        // io_uring stopped working so this worker goes back to plain syscalls
+        worker->uring_ready = 0;
+    }
+#endif
+
+    for (i = 0; i < count; i++)
+        scan_process_entry(pool->config, &worker->buffers, scan_batch_entry(&batch, i));
+    scan_move_flush(&worker->buffers.mover);
+}
+
+// buffers are the calling thread's, for the actions left to retiring (with --checkpoint)
+void scan_pool_complete(struct scan_pool* pool, struct scan_output* output, struct scan_buffers* buffers, size_t first, size_t count)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_slot* slot;
+    size_t end;
+    size_t i;
+
+    if (!config->ordered) {
+        for (i = 0; i < count; i++)
+            scan_report_entry(config, output, &pool->slots[(first + i) & pool->slots_mask].entry);
+        if (config->watch)
+            scan_output_flush(output);
+    }
+
+    pthread_mutex_lock(&pool->slots_lock);
+    for (i = 0; i < count; i++)
+        pool->slots[(first + i) & pool->slots_mask].done = 1;
+
+    // Only one thread reports at a time, the others just leave their finished entries for it to pick up
+    if (pool->reporting) {
+        pthread_mutex_unlock(&pool->slots_lock);
+        return;
+    }
+    pool->reporting = 1;
+
+    for (;;) {
+        while ((slot = &pool->slots[pool->next_report & pool->slots_mask])->done) {
+            if (config->ordered || config->index != NULL || config->checkpoint != NULL) {
+                // The actions on every entry finished so far are logged at once, before the first of them is done
+                // (up to the next checkpoint, which the ones before it are done by)
+                end = pool->next_report;
+                if (config->checkpoint != NULL && config->checkpoint->logged_actions == pool->next_report) {
+                    while (end - pool->next_report <= pool->slots_mask && end - pool->next_report < config->checkpoint->interval - config->checkpoint->since &&
+                           pool->slots[end & pool->slots_mask].done)
+                        end++;
+                }
+                pthread_mutex_unlock(&pool->slots_lock);
+                if (end != pool->next_report)
+                    scan_checkpoint_log_actions(pool, pool->next_report, end);
+                if (config->checkpoint != NULL && slot->entry.status == SCAN_EXTRACTED && scan_entry_wants_action(config, &slot->entry)) {
+                    SCAN_STATS_TIME(start);
+                    scan_act_entry(config, buffers, &slot->entry);
+                    // A copy to another file system has to be finished before it's reported
+                    scan_move_flush(&buffers->mover);
+                    SCAN_STATS_STAGE(SCAN_STAGE_RENAME, start);
+                }
+                if (config->ordered)
+                    scan_report_entry(config, &pool->output, &slot->entry);
+                if (config->index != NULL)
+                    scan_index_add(config, &slot->entry);
+                if (config->checkpoint != NULL && ++config->checkpoint->since == config->checkpoint->interval)
+                    scan_checkpoint_write(pool, slot);
+                pthread_mutex_lock(&pool->slots_lock);
+            }
+            slot->done = 0;
+            pool->next_report++;
+            pthread_cond_signal(&pool->slots_free);
+        }
+
+        // Nobody else can report until we're done so look again after flushing
+        if (!config->watch || !config->ordered || (pool->output.out.len == 0 && pool->output.err.len == 0))
+            break;
+        pthread_mutex_unlock(&pool->slots_lock);
+        scan_output_flush(&pool->output);
+        pthread_mutex_lock(&pool->slots_lock);
+    }
+
+    pool->reporting = 0;
+    pthread_mutex_unlock(&pool->slots_lock);
+}
+
+void* scan_worker_main(void* arg)
+{
+    struct scan_worker* worker = arg;
+    struct scan_queue_item item;
+
+    while (scan_pool_take(worker, &item)) {
+        uint64_t start = worker->pool->config->tune != NULL ? scan_tune_now() : 0;
+
+        scan_worker_process_batch(worker, item.first, item.count);
+        if (worker->pool->config->tune != NULL) {
+            atomic_fetch_add_explicit(&worker->busy_ns, scan_tune_now() - start, memory_order_relaxed);
+            atomic_fetch_add_explicit(&worker->busy_keys, item.count, memory_order_relaxed);
+        }
+        scan_pool_complete(worker->pool, &worker->output, &worker->buffers, item.first, item.count);
+    }
+
+    return NULL;
+}
+
+void scan_pool_destroy(struct scan_pool* pool)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool->workers_count; i++) {
+#ifdef HAVE_IO_URING
+        if (pool->workers[i].uring_ready)
+            scan_uring_destroy(&pool->workers[i].uring);
+#endif
+        scan_buffers_free(&pool->workers[i].buffers);
+        scan_arena_free(&pool->workers[i].arena);
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+    }
+    scan_arena_free(&pool->arena);
+    pthread_mutex_destroy(&pool->slots_lock);
+    pthread_cond_destroy(&pool->slots_free);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_wake);
+    pthread_cond_destroy(&pool->park_wake);
+    pthread_mutex_destroy(&pool->tune_lock);
+    pthread_cond_destroy(&pool->tune_wake);
+    pthread_mutex_destroy(&pool->progress_lock);
+    pthread_cond_destroy(&pool->progress_wake);
+    pthread_mutex_destroy(&pool->prefetch_lock);
+    pthread_cond_destroy(&pool->prefetch_wake);
+}
+
+size_t scan_pool_slots_count(const struct scan_config* config)
+{
+    size_t slots_count = 1;
+    size_t window = SCAN_ENTRIES_PER_WORKER;
+
+    // Room for at least one batch being filled while another is being processed
+    if (window < 2 * config->batch_size)
+        window = 2 * config->batch_size;
+    // Plus the entries held back for the prefetch stage
+    while (slots_count < (size_t)config->jobs * window + config->prefetch)
+        slots_count <<= 1;
+    return slots_count;
+}
+
+// Arena space of the pool itself
+size_t scan_pool_arena_size(const struct scan_config* config)
+{
+    size_t size = scan_arena_round(scan_pool_slots_count(config) * sizeof(struct scan_slot)) +
+                  scan_arena_round(config->jobs * sizeof(struct scan_worker)) + scan_output_size(config);
+
+#ifdef __linux__
+    size += scan_arena_round(config->dir_buffer_size);
+    if (config->inode_order)
+        size += scan_arena_round(config->dir_buffer_size / SCAN_GETDENTS_MIN_RECLEN * sizeof(struct linux_dirent64*));
+#endif
+    return size;
+}
+
+// Arena space of each worker
+size_t scan_worker_arena_size(const struct scan_config* config)
+{
+    size_t size = scan_arena_round(scan_pool_slots_count(config) * sizeof(struct scan_queue_item)) + scan_buffers_size(config) +
+                  scan_output_size(config);
+
+#ifdef HAVE_IO_URING
+    if (config->io == SCAN_IO_URING)
+        size += scan_uring_buffers_size(config->batch_size);
+#endif
+    return size;
+}
+
+int scan_pool_init(struct scan_pool* pool, const struct scan_config* config)
+{
+    size_t slots_count = scan_pool_slots_count(config);
+    unsigned int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->config = config;
+    pool->threaded = config->jobs > 1;
+    pool->slots_mask = slots_count - 1;
+
+    pthread_mutex_init(&pool->slots_lock, NULL);
+    pthread_cond_init(&pool->slots_free, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_wake, NULL);
+    pthread_cond_init(&pool->park_wake, NULL);
+    pthread_mutex_init(&pool->tune_lock, NULL);
+    pthread_cond_init(&pool->tune_wake, NULL);
+    pthread_mutex_init(&pool->progress_lock, NULL);
+    pthread_cond_init(&pool->progress_wake, NULL);
+    pthread_mutex_init(&pool->prefetch_lock, NULL);
+    pthread_cond_init(&pool->prefetch_wake, NULL);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->active_workers, config->tune != NULL ? scan_tune_value(config->tune, SCAN_TUNE_JOBS) : config->jobs);
+    atomic_init(&pool->prefetch_depth, config->tune != NULL && config->prefetch > 0 ? scan_tune_value(config->tune, SCAN_TUNE_PREFETCH) : config->prefetch);
+
+    if (scan_arena_init(&pool->arena, scan_pool_arena_size(config)) != 0) {
+        fprintf(stderr, "Failed to allocate scan queues\n");
+        scan_pool_destroy(pool);
+        return 1;
+    }
+    pool->slots = scan_arena_alloc(&pool->arena, slots_count * sizeof(*pool->slots));
+    pool->workers = scan_arena_alloc(&pool->arena, config->jobs * sizeof(*pool->workers));
+#ifdef __linux__
+    pool->dir_buf = scan_arena_alloc(&pool->arena, config->dir_buffer_size);
+    if (config->inode_order)
+        pool->dir_records = scan_arena_alloc(&pool->arena, config->dir_buffer_size / SCAN_GETDENTS_MIN_RECLEN * sizeof(*pool->dir_records));
+#endif
+    if (pool->slots == NULL || pool->workers == NULL) {
+        fprintf(stderr, "Failed to allocate scan queues\n");
+        scan_pool_destroy(pool);
+        return 1;
+    }
+
+    if (scan_output_init(&pool->output, config, &pool->arena) != 0) {
+        scan_pool_destroy(pool);
+        return 1;
+    }
+
+    for (i = 0; i < slots_count; i++)
+        pool->slots[i].entry.name = pool->slots[i].name;
+
+    for (i = 0; i < config->jobs; i++) {
+        struct scan_worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        pool->workers_count++;
+
+        if (scan_arena_init(&worker->arena, scan_worker_arena_size(config)) != 0 ||
+            (worker->queue.items = scan_arena_alloc(&worker->arena, slots_count * sizeof(*worker->queue.items))) == NULL) {
+            fprintf(stderr, "Failed to allocate scan queues\n");
+            scan_pool_destroy(pool);
+            return 1;
+        }
+
+        if (scan_buffers_init(&worker->buffers, config, &worker->arena) != 0 || scan_output_init(&worker->output, config, &worker->arena) != 0) {
+            scan_pool_destroy(pool);
+            return 1;
+        }
+
+#ifdef HAVE_IO_URING
+        // A worker that can't get a ring of its own quietly falls back to plain syscalls
+        if (config->io == SCAN_IO_URING && scan_uring_init(&worker->uring, config->batch_size) == 0) {
+            worker->uring_ready = 1;
+            if (scan_uring_init_buffers(&worker->uring, config->batch_size, &worker->arena) != 0) {
+                scan_pool_destroy(pool);
+                return 1;
+            }
+        }
+#endif
+    }
+
+    return 0;
+}
+
+void scan_pool_dispatch(struct scan_pool* pool, size_t first, size_t count)
+{
+    unsigned int active;
+
+    if (!pool->threaded) {
+        scan_worker_process_batch(&pool->workers[0], first, count);
+        scan_pool_complete(pool, &pool->workers[0].output, &pool->workers[0].buffers, first, count);
+        return;
+    }
+
+    active = atomic_load(&pool->active_workers);
+    if (pool->next_worker >= active)
+        pool->next_worker = 0;
+    scan_queue_push(&pool->workers[pool->next_worker].queue, pool->slots_mask, first, count);
+    pool->next_worker = (pool->next_worker + 1) % active;
+
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_wake);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Progress counter
+// A thread of its own wakes up every second and prints how many files have been retired since the last time
+void* scan_progress_main(void* arg)
+{
+    struct scan_pool* pool = arg;
+    struct timespec start;
+    struct timespec now;
+    struct timespec deadline;
+    size_t last = 0;
+    size_t done;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&pool->progress_lock);
+    while (!pool->progress_stop) {
+        deadline.tv_sec++;
+        if (pthread_cond_timedwait(&pool->progress_wake, &pool->progress_lock, &deadline) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_lock(&pool->slots_lock);
+        done = pool->next_report;
+        pthread_mutex_unlock(&pool->slots_lock);
+
+        fprintf(stderr, "Progress: %zu files (%zu files/s)\n", done, done - last);
+        last = done;
+    }
+    pthread_mutex_unlock(&pool->progress_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Processed %zu files in %.2f s (%.0f files/s)\n", pool->next_report, elapsed,
+            elapsed > 0 ? pool->next_report / elapsed : 0.0);
+
+    return NULL;
+}
+
+// The tuner (see Tuning)
+void scan_pool_apply_tune(struct scan_pool* pool)
+{
+    const struct scan_tune* tune = pool->config->tune;
+
+    atomic_store(&pool->prefetch_depth, scan_tune_value(tune, SCAN_TUNE_PREFETCH));
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->active_workers, scan_tune_value(tune, SCAN_TUNE_JOBS));
+    pthread_cond_broadcast(&pool->park_wake);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void scan_tune_print(const struct scan_config* config, const char* what, size_t jobs, size_t prefetch, double rate)
+{
+    fprintf(stderr, "%s -j %zu", what, jobs);
+    if (config->prefetch > 0)
+        fprintf(stderr, " --prefetch=%zu", prefetch);
+    fprintf(stderr, " (%.0f files/s, %.1f us per key per worker)\n", rate, config->tune->key_ns / 1000);
+}
+
+// The settings kept, to pin on this host
+void scan_tune_report(const struct scan_config* config)
+{
+    const struct scan_tune* tune = config->tune;
+
+    // Over before the first sample, so there's nothing worth pinning
+    if (tune->rate == 0 && tune->sample_rate == 0) {
+        fprintf(stderr, "Not tuned: the scan ended before the first measurement (at -j %zu)\n", tune->knobs[SCAN_TUNE_JOBS].value);
+        return;
+    }
+    scan_tune_print(config, tune->setting == SCAN_TUNE_SETTLED ? "Tuned to" : "Still tuning at", tune->knobs[SCAN_TUNE_JOBS].value,
+                    tune->knobs[SCAN_TUNE_PREFETCH].value, tune->rate != 0 ? tune->rate : tune->sample_rate);
+}
+
+void* scan_tune_main(void* arg)
+{
+    struct scan_pool* pool = arg;
+    const struct scan_config* config = pool->config;
+    struct scan_tune* tune = config->tune;
+    struct timespec deadline;
+    uint64_t last_time = scan_tune_now();
+    uint64_t last_busy = 0;
+    size_t last_keys = 0;
+    int was_settled = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&pool->tune_lock);
+    while (!pool->tune_stop) {
+        uint64_t now;
+        uint64_t busy = 0;
+        size_t keys = 0;
+        size_t jobs = scan_tune_value(tune, SCAN_TUNE_JOBS);
+        size_t prefetch = scan_tune_value(tune, SCAN_TUNE_PREFETCH);
+        unsigned int i;
+
+        deadline.tv_nsec += SCAN_TUNE_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!pool->tune_stop && pthread_cond_timedwait(&pool->tune_wake, &pool->tune_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (pool->tune_stop)
+            break;
+
+        now = scan_tune_now();
+        for (i = 0; i < pool->workers_count; i++) {
+            busy += atomic_load_explicit(&pool->workers[i].busy_ns, memory_order_relaxed);
+            keys += atomic_load_explicit(&pool->workers[i].busy_keys, memory_order_relaxed);
+        }
+
+        // Nothing processed (e.g. a slow directory listing) says nothing about the settings
+        if (keys != last_keys) {
+            tune->sample_rate = (keys - last_keys) * 1e9 / (now - last_time);
+            tune->key_ns = (double)(busy - last_busy) / (keys - last_keys);
+            scan_tune_sample(tune, tune->sample_rate);
+            if (scan_tune_value(tune, SCAN_TUNE_JOBS) != jobs || scan_tune_value(tune, SCAN_TUNE_PREFETCH) != prefetch)
+                scan_pool_apply_tune(pool);
+
+            if (config->progress && !was_settled)
+                scan_tune_print(config, "Tuning:", jobs, prefetch, tune->sample_rate);
+            if (config->progress && !was_settled && tune->setting == SCAN_TUNE_SETTLED)
+                scan_tune_report(config);
+            was_settled = tune->setting == SCAN_TUNE_SETTLED;
+        }
+        last_time = now;
+        last_busy = busy;
+        last_keys = keys;
+    }
+    pthread_mutex_unlock(&pool->tune_lock);
+
+    return NULL;
+}
+
+// Prefetching
+//
+// With a cold page cache each key costs a synchronous disk round trip for its inode and another for its data, and the
+// device sits idle while the key is parsed even though the directory order says exactly which keys come next. With
+// --prefetch=N a thread of its own warms the N entries enumerated ahead of the ones handed to the workers: it stats
+// whatever the worker is going to stat, then opens the key and asks for its first block with
+// posix_fadvise(WILLNEED), which queues the read without waiting for it. By the time a worker gets to a key its
+// inode and data are in memory, so the device has work queued even with a single job
+// The enumerator holds each batch back until it's N entries further along. Entries that haven't been dispatched
+// can't be processed or recycled, so the prefetcher copies out what it needs under a lock and then works without one
+// An entry the workers got to first is skipped. Index hits are only stat'ed
+// Only the sync I/O path has this stage (io_uring keeps every read of a batch in flight already), and only where
+// there's posix_fadvise (--prefetch does nothing without it)
+
+// Warm one key (dirfd and name are copies as the entry may be processed in the meantime)
+void scan_prefetch_file(const struct scan_config* config, int dirfd, const char* name, unsigned char d_type)
+{
+    struct scan_entry probe;
+    struct stat stbuf;
+    unsigned int timestamp;
+    int kind;
+    int fd;
+
+    probe.name = name;
+    probe.d_type = d_type;
+    kind = scan_entry_kind(&probe);
+    if (kind == SCAN_KIND_SKIP)
+        return;
+
+    if (kind == SCAN_KIND_STAT || config->index != NULL) {
+        // Only regular files are opened (a FIFO would block)
+        if (fstatat(dirfd, name, &stbuf, 0) == -1 || !S_ISREG(stbuf.st_mode) || stbuf.st_size == 0)
+            return;
+        probe.ino = stbuf.st_ino;
+        probe.size = stbuf.st_size;
+        probe.mtime_ns = (int64_t)stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec;
+        if (config->index != NULL && scan_index_lookup(config->index, &probe, &timestamp) == 0)
+            return;
+    }
+
+    if ((fd = pgp_key_open(dirfd, name)) == -1)
+        return;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, PGP_KEY_HEADER_SIZE, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+}
+
+void* scan_prefetch_main(void* arg)
+{
+    struct scan_pool* pool = arg;
+    const struct scan_config* config = pool->config;
+    const struct scan_entry* entry;
+    char name[PATH_MAX];
+    size_t name_len;
+    int dirfd;
+    unsigned char d_type;
+
+    pthread_mutex_lock(&pool->prefetch_lock);
+    for (;;) {
+        // Whatever the workers already have is too late to warm
+        if (pool->prefetch_next < pool->dispatch_first)
+            pool->prefetch_next = pool->dispatch_first;
+        if (pool->prefetch_next == pool->prefetch_end) {
+            if (pool->prefetch_stop)
+                break;
+            pthread_cond_wait(&pool->prefetch_wake, &pool->prefetch_lock);
+            continue;
+        }
+
+        entry = &pool->slots[pool->prefetch_next++ & pool->slots_mask].entry;
+        // File list paths can be longer than a slot's name
+        name_len = strlen(entry->name);
+        if (name_len >= sizeof(name))
+            continue;
+        memcpy(name, entry->name, name_len + 1);
+        dirfd = scan_entry_dirfd(config, entry);
+        d_type = entry->d_type;
+        pthread_mutex_unlock(&pool->prefetch_lock);
+
+        SCAN_STATS_TIME(start);
+        scan_prefetch_file(config, dirfd, name, d_type);
+        SCAN_STATS_STAGE(SCAN_STAGE_PREFETCH, start);
+
+        pthread_mutex_lock(&pool->prefetch_lock);
+    }
+    pthread_mutex_unlock(&pool->prefetch_lock);
+
+    return NULL;
+}
+
+// Let the prefetcher know about the entries up to end
+void scan_prefetch_publish(struct scan_pool* pool, size_t end)
+{
+    pthread_mutex_lock(&pool->prefetch_lock);
+    pool->prefetch_end = end;
+    pthread_cond_signal(&pool->prefetch_wake);
+    pthread_mutex_unlock(&pool->prefetch_lock);
+}
+
+void scan_prefetch_stop(struct scan_pool* pool)
+{
+    if (!pool->prefetch_started)
+        return;
+
+    pthread_mutex_lock(&pool->prefetch_lock);
+    pool->prefetch_stop = 1;
+    pthread_cond_signal(&pool->prefetch_wake);
+    pthread_mutex_unlock(&pool->prefetch_lock);
+    pthread_join(pool->prefetch_thread, NULL);
+    pool->prefetch_started = 0;
+}
+
+int scan_pool_start(struct scan_pool* pool)
+{
+    if (pool->config->progress) {
+        if (pthread_create(&pool->progress_thread, NULL, scan_progress_main, pool) != 0) {
+            fprintf(stderr, "Failed to start progress thread\n");
+            return 1;
+        }
+        pool->progress_started = 1;
+    }
+
+    if (pool->config->tune != NULL) {
+        if (pthread_create(&pool->tune_thread, NULL, scan_tune_main, pool) != 0) {
+            fprintf(stderr, "Failed to start tuning thread\n");
+            return 1;
+        }
+        pool->tune_started = 1;
+    }
+
+    if (pool->config->prefetch > 0) {
+        if (pthread_create(&pool->prefetch_thread, NULL, scan_prefetch_main, pool) != 0) {
+            fprintf(stderr, "Failed to start prefetch thread\n");
+            return 1;
+        }
+        pool->prefetch_started = 1;
+    }
+
+    if (!pool->threaded)
+        return 0;
+
+    for (; pool->workers_started < pool->workers_count; pool->workers_started++) {
+        struct scan_worker* worker = &pool->workers[pool->workers_started];
+        if (pthread_create(&worker->thread, NULL, scan_worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Slot for the next entry (blocks while the reorder window is full)
+struct scan_slot* scan_pool_reserve(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+
+    // Wait for the oldest entries to be reported so the reorder window doesn't grow without bound
+    if (pool->next_seq == pool->batch_first) {
+        pthread_mutex_lock(&pool->slots_lock);
+        while (pool->next_seq + config->batch_size - pool->next_report > pool->slots_mask + 1)
+            pthread_cond_wait(&pool->slots_free, &pool->slots_lock);
+        pthread_mutex_unlock(&pool->slots_lock);
+    }
+
+    return &pool->slots[pool->next_seq & pool->slots_mask];
+}
+
+// Hand the entries from dispatch_first up to end to the workers (in batches of at most batch_size)
+void scan_pool_dispatch_until(struct scan_pool* pool, size_t end)
+{
+    const struct scan_config* config = pool->config;
+    size_t first;
+    size_t count;
+
+    while (pool->dispatch_first != end) {
+        first = pool->dispatch_first;
+        count = end - first < config->batch_size ? end - first : config->batch_size;
+
+        // Out of the prefetcher's reach before a worker can get to them
+        if (pool->prefetch_started) {
+            pthread_mutex_lock(&pool->prefetch_lock);
+            pool->dispatch_first = first + count;
+            pthread_mutex_unlock(&pool->prefetch_lock);
+        }
+        else
+            pool->dispatch_first = first + count;
+
+        scan_pool_dispatch(pool, first, count);
+    }
+}
+
+// Hand the reserved slot to the pipeline
+void scan_pool_push(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    size_t depth;
+
+    ++pool->next_seq;
+    if (pool->prefetch_started)
+        scan_prefetch_publish(pool, pool->next_seq);
+
+    if (pool->next_seq - pool->batch_first == config->batch_size) {
+        pool->batch_first = pool->next_seq;
+        // With a prefetch stage the batch waits until the enumerator is far enough past it
+        depth = atomic_load_explicit(&pool->prefetch_depth, memory_order_relaxed);
+        if (pool->next_seq - pool->dispatch_first >= config->batch_size + depth)
+            scan_pool_dispatch_until(pool, pool->next_seq - depth);
+    }
+}
+
+// Hand one directory entry to the pipeline
+void scan_pool_add(struct scan_pool* pool, const char* name, unsigned char d_type, ino_t ino)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_slot* slot;
+    size_t name_len;
+
+    if (scan_select_done(config))
+        return;
+
+    if (pool->tree != NULL && scan_tree_add_subdir(pool, name, d_type))
+        return;
+    if (pool->skip_files)
+        return;
+
+    if (!scan_dirent_wanted(name, d_type) || !scan_shard_wanted(config, pool->current_dir != NULL ? pool->current_dir->prefix : "", name))
+        return;
+
+    name_len = strlen(name);
+    if (name_len > NAME_MAX) {
+        fprintf(stderr, "File name too long: %s/%s\n", config->source_dir, name);
+        return;
+    }
+
+    slot = scan_pool_reserve(pool);
+    memcpy(slot->name, name, name_len + 1);
+    slot->entry.name = slot->name;
+    slot->entry.dir = pool->current_dir;
+    slot->entry.d_type = d_type;
+    slot->entry.ino = ino;
+    slot->cookie = pool->cookie;
+    scan_pool_push(pool);
+}
+
+// Dispatch the batch being filled even though it isn't full (along with any held back for the prefetcher)
+void scan_pool_flush(struct scan_pool* pool)
+{
+    scan_pool_dispatch_until(pool, pool->next_seq);
+    pool->batch_first = pool->next_seq;
+}
+
+// Wait until every entry before seq has been reported
+void scan_pool_wait_retired(struct scan_pool* pool, size_t seq)
+{
+    // The entries still in the batch being filled wouldn't get processed otherwise
+    scan_pool_flush(pool);
+
+    pthread_mutex_lock(&pool->slots_lock);
+    while (pool->next_report < seq)
+        pthread_cond_wait(&pool->slots_free, &pool->slots_lock);
+    pthread_mutex_unlock(&pool->slots_lock);
+}
+
+// Dispatch whatever is left over and wait for every entry to be processed and reported
+void scan_pool_finish(struct scan_pool* pool)
+{
+    unsigned int i;
+
+    scan_pool_flush(pool);
+    scan_prefetch_stop(pool);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->enumeration_done = 1;
+    pthread_cond_broadcast(&pool->idle_wake);
+    pthread_cond_broadcast(&pool->park_wake);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    while (pool->workers_started > 0)
+        pthread_join(pool->workers[--pool->workers_started].thread, NULL);
+
+    for (i = 0; i < pool->workers_count; i++)
+        scan_output_flush(&pool->workers[i].output);
+    scan_output_flush(&pool->output);
+
+    if (pool->progress_started) {
+        pthread_mutex_lock(&pool->progress_lock);
+        pool->progress_stop = 1;
+        pthread_cond_signal(&pool->progress_wake);
+        pthread_mutex_unlock(&pool->progress_lock);
+        pthread_join(pool->progress_thread, NULL);
+        pool->progress_started = 0;
+    }
+
+    if (pool->tune_started) {
+        pthread_mutex_lock(&pool->tune_lock);
+        pool->tune_stop = 1;
+        pthread_cond_signal(&pool->tune_wake);
+        pthread_mutex_unlock(&pool->tune_lock);
+        pthread_join(pool->tune_thread, NULL);
+        pool->tune_started = 0;
+        if (!pool->config->quiet)
+            scan_tune_report(pool->config);
+    }
+}
+
+int scan_enumerate_readdir(struct scan_pool* pool, DIR* dir)
+{
+    struct dirent *dirent;
+
+    for (;;) {
+        SCAN_STATS_TIME(start);
+        dirent = readdir(dir);
+        SCAN_STATS_STAGE(SCAN_STAGE_READDIR, start);
+        if (dirent == NULL || scan_select_done(pool->config))
+            break;
+        scan_pool_add(pool, dirent->d_name, DIRENT_TYPE(dirent), dirent->d_ino);
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+// Bulk directory enumeration
+//
+// glibc's readdir() fills a 32 KiB buffer per getdents64 call, which is thousands of syscalls for a
+// directory with tens of millions of entries. We call getdents64 ourselves with a much bigger buffer instead.
+// With --inode-order each buffer's worth of entries is sorted by inode number before it's handed to the
+// pipeline so files are read in roughly on-disk order (a big win on spinning disks and ext4).
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int scan_dirent_ino_compare(const void* a, const void* b)
+{
+    const struct linux_dirent64* x = *(const struct linux_dirent64* const*)a;
+    const struct linux_dirent64* y = *(const struct linux_dirent64* const*)b;
+
+    return (x->d_ino > y->d_ino) - (x->d_ino < y->d_ino);
+}
+
+int scan_enumerate_getdents(struct scan_pool* pool, int fd)
+{
+    const struct scan_config* config = pool->config;
+    char* buf = pool->dir_buf;
+    const struct linux_dirent64** records = pool->dir_records;
+    size_t records_count;
+    long len;
+    long pos;
+    size_t i;
+
+    for (;;) {
+        SCAN_STATS_TIME(start);
+        len = syscall(SYS_getdents64, fd, buf, config->dir_buffer_size);
+        SCAN_STATS_STAGE(SCAN_STAGE_READDIR, start);
+        if (len <= 0 || scan_select_done(config))
+            break;
+
+        records_count = 0;
+
+        for (pos = 0; pos < len; ) {
+            const struct linux_dirent64* dirent = (const struct linux_dirent64*)(buf + pos);
+            pos += dirent->d_reclen;
+
+            if (config->inode_order)
+                records[records_count++] = dirent;
+            else {
+                pool->cookie = dirent->d_off;
+                scan_pool_add(pool, dirent->d_name, dirent->d_type, dirent->d_ino);
+            }
+        }
+
+        if (config->inode_order) {
+            qsort(records, records_count, sizeof(*records), scan_dirent_ino_compare);
+            for (i = 0; i < records_count; i++)
+                scan_pool_add(pool, records[i]->d_name, records[i]->d_type, records[i]->d_ino);
+        }
+    }
+
+    if (len < 0) {
+        fprintf(stderr, "Failed to read directory %s\n", config->source_dir);
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+// File list input
+//
+// Paths (relative to the source directory) are read from a file or pipe in large blocks and split in place, so each
+// entry's name points straight into the block it was read into instead of being copied into its slot
+// Entries are retired strictly in sequence order, so a block can be reused once the last entry from it is retired
+// A short read means the writer has nothing more for us right now, so the partial batch is dispatched straight
+// away to keep latency down when sitting in a pipeline behind the key generator
+// The list is NUL delimited if the first block has a NUL in it (e.g. find -print0), otherwise newline delimited
+// A list in a regular file is mapped instead and split where it lies, so there's nothing to read or recycle. The
+// mapping is private, so a NUL delimited list is used as is and only a newline delimited one has its pages copied
+// (on the first write of a delimiter)
+
+#define SCAN_FILES_FROM_BLOCK_SIZE (1024 * 1024)
+#define SCAN_FILES_FROM_BLOCKS 4
+
+struct scan_files_from_block {
+    char* buf;
+    // Sequence number after the last entry in this block
+    size_t end_seq;
+};
+
+void scan_files_from_add(struct scan_pool* pool, char* path)
+{
+    struct scan_slot* slot;
+
+    if (!scan_shard_wanted(pool->config, "", path))
+        return;
+
+    slot = scan_pool_reserve(pool);
+    // Only readable files are expected so go straight to opening them without a stat
+    // (a listed directory fails to read, an empty file is still skipped quietly)
+    slot->entry.name = path;
+    slot->entry.dir = NULL;
+    slot->entry.d_type = DT_REG;
+    slot->entry.ino = 0;
+    scan_pool_push(pool);
+}
+
+int scan_enumerate_files_from_map(struct scan_pool* pool, char* map, size_t size)
+{
+    char* end = map + size;
+    char* last = NULL;
+    char* p;
+    int delim;
+
+    madvise(map, size, MADV_SEQUENTIAL);
+    delim = memchr(map, '\0', size < SCAN_FILES_FROM_BLOCK_SIZE ? size : SCAN_FILES_FROM_BLOCK_SIZE) != NULL ? '\0' : '\n';
+
+    for (p = map; p < end && !scan_select_done(pool->config); ) {
+        char* next = memchr(p, delim, end - p);
+
+        // A last path without a delimiter can't be terminated in place (the file may end on a page boundary)
+        if (next == NULL) {
+            if ((last = scan_mem_alloc(end - p + 1)) == NULL) {
+                fprintf(stderr, "Failed to allocate file list buffers\n");
+                break;
+            }
+            memcpy(last, p, end - p);
+            last[end - p] = '\0';
+            scan_files_from_add(pool, last);
+            break;
+        }
+
+        if (delim != '\0')
+            *next = '\0';
+        if (next != p)
+            scan_files_from_add(pool, p);
+        p = next + 1;
+    }
+
+    // Every entry has to be retired before the mapping goes away
+    scan_pool_wait_retired(pool, pool->next_seq);
+    munmap(map, size);
+    scan_mem_free(last);
+    return 0;
+}
+
+int scan_enumerate_files_from(struct scan_pool* pool, int fd)
+{
+    struct scan_files_from_block blocks[SCAN_FILES_FROM_BLOCKS] = { 0 };
+    const struct scan_config* config = pool->config;
+    unsigned int current = 0;
+    size_t carry = 0;
+    int delim = -1;
+    int ret = 0;
+    unsigned int i;
+    struct stat stbuf;
+    char* map;
+
+    if (fstat(fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode) && stbuf.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0 &&
+        (map = mmap(NULL, stbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+        return scan_enumerate_files_from_map(pool, map, stbuf.st_size);
+
+    for (i = 0; i < SCAN_FILES_FROM_BLOCKS; i++) {
+        // 1 extra byte to terminate a last path that has no delimiter
+        blocks[i].buf = scan_mem_alloc(SCAN_FILES_FROM_BLOCK_SIZE + 1);
+        if (blocks[i].buf == NULL) {
+            fprintf(stderr, "Failed to allocate file list buffers\n");
+            ret = 1;
+            goto out;
+        }
+    }
+
+    for (;;) {
+        struct scan_files_from_block* block = &blocks[current];
+        const struct scan_files_from_block* previous = &blocks[(current + SCAN_FILES_FROM_BLOCKS - 1) % SCAN_FILES_FROM_BLOCKS];
+        char* p;
+        char* end;
+        size_t want;
+        ssize_t len;
+
+        // Wait until no entry points into the block anymore
+        scan_pool_wait_retired(pool, block->end_seq);
+        if (scan_select_done(config))
+            break;
+
+        // The partial path at the end of the previous block starts off this one
+        if (carry > 0)
+            memcpy(block->buf, previous->buf + SCAN_FILES_FROM_BLOCK_SIZE - carry, carry);
+
+        want = SCAN_FILES_FROM_BLOCK_SIZE - carry;
+        len = read(fd, block->buf + carry, want);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to read file list\n");
+            ret = 1;
+            break;
+        }
+
+        if (delim == -1 && len > 0)
+            delim = memchr(block->buf, '\0', carry + len) != NULL ? '\0' : '\n';
+
+        p = block->buf;
+        end = block->buf + carry + len;
+        for (;;) {
+            char* next = memchr(p, delim, end - p);
+            if (next == NULL)
+                break;
+            *next = '\0';
+            if (next != p)
+                scan_files_from_add(pool, p);
+            p = next + 1;
+        }
+
+        if (len == 0) {
+            if (p != end) {
+                *end = '\0';
+                scan_files_from_add(pool, p);
+            }
+            break;
+        }
+
+        // Keep the partial path right at the end of the block so the next block can pick it up from there
+        carry = end - p;
+        if (carry == SCAN_FILES_FROM_BLOCK_SIZE) {
+            fprintf(stderr, "Path too long in file list of %s\n", config->source_dir);
+            ret = 1;
+            break;
+        }
+        if (p + carry != block->buf + SCAN_FILES_FROM_BLOCK_SIZE)
+            memmove(block->buf + SCAN_FILES_FROM_BLOCK_SIZE - carry, p, carry);
+
+        block->end_seq = pool->next_seq;
+        current = (current + 1) % SCAN_FILES_FROM_BLOCKS;
+
+        if ((size_t)len < want)
+            scan_pool_flush(pool);
+    }
+
+    // Every entry has to be retired before the blocks go away
+    scan_pool_wait_retired(pool, pool->next_seq);
+
+out:
+    for (i = 0; i < SCAN_FILES_FROM_BLOCKS; i++)
+        scan_mem_free(blocks[i].buf);
+    return ret;
+}
+
+// Recursive scan
+//
+// Candidates sharded into subdirectories (e.g. 00/ to ff/) are walked depth first from the enumerating thread while
+// the workers process the keys in parallel as usual. Each directory is a task with an fd of its own that every
+// entry in it is opened, stat'ed and moved relative to (plus a destination fd with the same relative path, created
+// if needed, when moving). Reading a directory is one getdents64 per ~100k names so it's the keys that need the
+// parallelism, and walking from one thread keeps the output order deterministic
+// Directories are opened in order and their entries are retired in order, so the open directories form a FIFO:
+// once it's as long as the fd budget allows, the oldest directory is closed as soon as its last entry is retired
+// Subdirectories are opened by their path relative to the source directory, so only the current directory (and
+// the directories with entries still in flight) are open at any time. Symlinks to directories aren't followed
+// The paths of the subdirectories still to walk are kept back to back in a slab, a group of them for each
+// directory on the way down (its subdirectories, walked in the order they were listed). A group is dropped from
+// the end of the slab once its last subdirectory is opened, so the slab only holds the siblings of the directories
+// being walked. Each open directory copies its path into a fixed buffer of its own
+
+// Every path component takes at least 2 bytes ("a/")
+#define SCAN_TREE_MAX_DEPTH (PATH_MAX / 2)
+
+struct scan_tree_group {
+    // Offsets into names: where the group starts and the path of the next subdirectory to walk
+    size_t first;
+    size_t next;
+};
+
+struct scan_tree {
+    // FIFO of open directories
+    struct scan_dir* dirs;
+    unsigned int budget;
+    size_t oldest;
+    size_t next;
+    // PATH_MAX for each directory in the FIFO
+    char* prefixes;
+
+    // Subdirectory paths still to walk, the last group is the one at the end of the slab
+    struct scan_slab names;
+    struct scan_tree_group* groups;
+    size_t groups_count;
+
+    // dirs, prefixes and groups
+    struct scan_arena arena;
+};
+
+// Returns 1 if the entry was a subdirectory (which is queued up unless it's hidden)
+int scan_tree_add_subdir(struct scan_pool* pool, const char* name, unsigned char d_type)
+{
+    struct scan_tree* tree = pool->tree;
+    const char* prefix = pool->current_dir->prefix;
+    struct stat stbuf;
+    size_t prefix_len;
+    size_t name_len;
+    size_t offset;
+
+    if (d_type == DT_UNKNOWN) {
+        if (name[0] == '.' || fstatat(pool->current_dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            return 0;
+        if (!S_ISDIR(stbuf.st_mode))
+            return 0;
+    }
+    else if (d_type != DT_DIR)
+        return 0;
+
+    if (name[0] == '.' || pool->skip_subdirs)
+        return 1;
+
+    // A destination inside the source would otherwise be walked (and mirrored into itself) over and over
+    if (pool->config->dest_dirfd != -1) {
+        if (d_type != DT_UNKNOWN && fstatat(pool->current_dir->fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            return 1;
+        if (stbuf.st_dev == pool->config->dest_dev && stbuf.st_ino == pool->config->dest_ino)
+            return 1;
+    }
+
+    prefix_len = strlen(prefix);
+    name_len = strlen(name);
+    if (prefix_len + name_len + 2 > PATH_MAX) {
+        fprintf(stderr, "Path too long: %s/%s%s\n", pool->config->source_dir, prefix, name);
+        return 1;
+    }
+
+    if ((offset = scan_slab_reserve(&tree->names, prefix_len + name_len + 2)) == SIZE_MAX) {
+        fprintf(stderr, "Failed to allocate directory queue, skipping %s/%s%s\n", pool->config->source_dir, prefix, name);
+        return 1;
+    }
+    memcpy(tree->names.data + offset, prefix, prefix_len);
+    memcpy(tree->names.data + offset + prefix_len, name, name_len);
+    memcpy(tree->names.data + offset + prefix_len + name_len, "/", 2);
+
+    return 1;
+}
+
+void scan_tree_close_dir(struct scan_dir* dir)
+{
+    if (!dir->owned)
+        return;
+
+    close(dir->fd);
+    if (dir->dest_fd >= 0)
+        close(dir->dest_fd);
+}
+
+// The destination of a subdirectory, created along with any of its parents that aren't there yet on the first key
+// moved into it so the destination only mirrors the directories that had a match (-1 if it can't be created)
+int scan_tree_dest_fd(const struct scan_config* config, struct scan_dir* dir)
+{
+    int dest_fd = atomic_load(&dir->dest_fd);
+    int expected = SCAN_DIR_DEST_UNOPENED;
+    char path[PATH_MAX];
+    char* slash;
+
+    if (dest_fd != SCAN_DIR_DEST_UNOPENED)
+        return dest_fd == SCAN_DIR_DEST_FAILED ? -1 : dest_fd;
+
+    // Workers racing on the same directory both create it (mkdirat is fine with that) and the first to open it wins
+    strcpy(path, dir->prefix);
+    for (slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(config->dest_dirfd, path, 0755) == -1 && errno != EEXIST)
+            break;
+        *slash = '/';
+    }
+    if (slash == NULL)
+        dest_fd = openat(config->dest_dirfd, dir->prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dest_fd < 0) {
+        if (atomic_compare_exchange_strong(&dir->dest_fd, &expected, SCAN_DIR_DEST_FAILED))
+            fprintf(stderr, "Can't create directory %s/%s\n", config->dest_dir, slash != NULL ? path : dir->prefix);
+        return -1;
+    }
+    if (!atomic_compare_exchange_strong(&dir->dest_fd, &expected, dest_fd)) {
+        close(dest_fd);
+        return expected == SCAN_DIR_DEST_FAILED ? -1 : expected;
+    }
+    return dest_fd;
+}
+
+// Close the oldest directories until there's room under the fd budget for one more
+void scan_tree_reclaim(struct scan_pool* pool, unsigned int keep)
+{
+    struct scan_tree* tree = pool->tree;
+
+    while (tree->next - tree->oldest > keep) {
+        struct scan_dir* dir = &tree->dirs[tree->oldest % tree->budget];
+
+        scan_pool_wait_retired(pool, dir->end_seq);
+        scan_tree_close_dir(dir);
+        tree->oldest++;
+    }
+}
+
+// Open a subdirectory into the FIFO, returns NULL if it can't be walked
+struct scan_dir* scan_tree_open_dir(struct scan_pool* pool, const char* path)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_tree* tree = pool->tree;
+    struct scan_dir* dir;
+    int fd;
+
+    scan_tree_reclaim(pool, tree->budget - 1);
+
+    if ((fd = openat(config->source_dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "Can't open directory %s/%s\n", config->source_dir, path);
+        return NULL;
+    }
+
+    dir = &tree->dirs[tree->next % tree->budget];
+    dir->fd = fd;
+    dir->dest_fd = config->dest_dirfd != -1 ? SCAN_DIR_DEST_UNOPENED : -1;
+    dir->prefix = tree->prefixes + tree->next++ % tree->budget * PATH_MAX;
+    strcpy(dir->prefix, path);
+    dir->owned = 1;
+    return dir;
+}
+
+int scan_enumerate_dir(struct scan_pool* pool, int fd)
+{
+#ifdef __linux__
+    return scan_enumerate_getdents(pool, fd);
+#else
+    DIR* dir;
+    int dup_fd;
+    int ret;
+
+    // closedir closes the fd it was opened from but the directory's fd has to outlive its entries
+    if ((dup_fd = dup(fd)) == -1 || (dir = fdopendir(dup_fd)) == NULL) {
+        if (dup_fd != -1)
+            close(dup_fd);
+        fprintf(stderr, "Failed to read directory %s\n", pool->config->source_dir);
+        return 1;
+    }
+    ret = scan_enumerate_readdir(pool, dir);
+    closedir(dir);
+    return ret;
+#endif
+}
+
+#ifdef __linux__
+// --resume: carry on with a directory's keys after the checkpoint
+int scan_checkpoint_seek(struct scan_pool* pool, int fd)
+{
+    struct scan_checkpoint* checkpoint = pool->config->checkpoint;
+
+    checkpoint->resuming = 0;
+    if (lseek(fd, checkpoint->resume_cookie, SEEK_SET) == -1) {
+        fprintf(stderr, "Can't seek to the checkpoint in %s/%s\n", pool->config->source_dir, checkpoint->resume_prefix);
+        return 1;
+    }
+    return 0;
+}
+
+// --resume: list one of the directories on the way down to the checkpoint (see Checkpoints)
+int scan_tree_resume_dir(struct scan_pool* pool, struct scan_dir* dir)
+{
+    struct scan_checkpoint* checkpoint = pool->config->checkpoint;
+    struct scan_slab* names = &pool->tree->names;
+    size_t first = names->len;
+    size_t i;
+    int ret;
+
+    // Its keys were all processed before the checkpoint (up to it in the directory the checkpoint is in)
+    pool->skip_files = 1;
+    ret = scan_enumerate_getdents(pool, dir->fd);
+    pool->skip_files = 0;
+
+    if (strcmp(dir->prefix, checkpoint->resume_prefix) == 0) {
+        pool->skip_subdirs = 1;
+        ret |= scan_checkpoint_seek(pool, dir->fd) || scan_enumerate_getdents(pool, dir->fd);
+        pool->skip_subdirs = 0;
+        return ret;
+    }
+
+    // The subdirectories listed before the one the checkpoint is in have been walked
+    for (i = first; i < names->len; i += strlen(names->data + i) + 1) {
+        if (strncmp(names->data + i, checkpoint->resume_prefix, strlen(names->data + i)) == 0)
+            break;
+    }
+    if (i == names->len) {
+        fprintf(stderr, "Directory %s/%s from the checkpoint is gone, walking every subdirectory of %s/%s again\n",
+                pool->config->source_dir, checkpoint->resume_prefix, pool->config->source_dir, dir->prefix);
+        checkpoint->resuming = 0;
+        return ret;
+    }
+    memmove(names->data + first, names->data + i, names->len - i);
+    names->len -= i - first;
+    return ret;
+}
+#endif
+
+// Budget of directory fds: a share of the fd limit leaving room for the workers' key files and everything else
+unsigned int scan_tree_fd_budget(const struct scan_config* config)
+{
+    struct rlimit limit;
+    rlim_t budget = 256;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        rlim_t reserved = 64 + config->jobs;
+        budget = limit.rlim_cur > reserved ? (limit.rlim_cur - reserved) / (config->dest_dirfd != -1 ? 2 : 1) : 1;
+    }
+
+    if (budget < 1)
+        budget = 1;
+    if (budget > 256)
+        budget = 256;
+    return budget;
+}
+
+// Arena space of the walk
+size_t scan_tree_arena_size(const struct scan_config* config)
+{
+    unsigned int budget = scan_tree_fd_budget(config);
+
+    return scan_arena_round(budget * sizeof(struct scan_dir)) + scan_arena_round((size_t)budget * PATH_MAX) +
+           scan_arena_round(SCAN_TREE_MAX_DEPTH * sizeof(struct scan_tree_group));
+}
+
+int scan_enumerate_tree(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_tree tree = { 0 };
+    struct scan_dir* dir;
+    int ret = 0;
+
+    tree.budget = scan_tree_fd_budget(config);
+    if (scan_arena_init(&tree.arena, scan_tree_arena_size(config)) != 0) {
+        fprintf(stderr, "Failed to allocate directory queue\n");
+        return 1;
+    }
+    tree.dirs = scan_arena_alloc(&tree.arena, tree.budget * sizeof(*tree.dirs));
+    tree.prefixes = scan_arena_alloc(&tree.arena, (size_t)tree.budget * PATH_MAX);
+    tree.groups = scan_arena_alloc(&tree.arena, SCAN_TREE_MAX_DEPTH * sizeof(*tree.groups));
+    pool->tree = &tree;
+
+    // The source directory itself (its fds belong to main)
+    dir = &tree.dirs[tree.next++];
+    dir->fd = config->source_dirfd;
+    dir->dest_fd = config->dest_dirfd;
+    dir->prefix = "";
+
+    for (;;) {
+        size_t first = tree.names.len;
+
+        pool->current_dir = dir;
+#ifdef __linux__
+        if (config->checkpoint != NULL && config->checkpoint->resuming)
+            ret |= scan_tree_resume_dir(pool, dir);
+        else
+#endif
+        ret |= scan_enumerate_dir(pool, dir->fd);
+        dir->end_seq = pool->next_seq;
+
+        // Its subdirectories are walked next, in the order they were listed (a group is at most one level deeper
+        // than the directory it was listed in, so there's always room)
+        if (tree.names.len > first) {
+            tree.groups[tree.groups_count].first = first;
+            tree.groups[tree.groups_count++].next = first;
+        }
+
+        do {
+            struct scan_tree_group* group;
+            const char* path;
+
+            if (tree.groups_count == 0 || scan_select_done(config))
+                goto out;
+            group = &tree.groups[tree.groups_count - 1];
+            path = tree.names.data + group->next;
+            group->next += strlen(path) + 1;
+            dir = scan_tree_open_dir(pool, path);
+            if (dir == NULL)
+                ret = 1;
+            // The path has been copied so the group can go once it's the last one
+            if (group->next == tree.names.len) {
+                tree.names.len = group->first;
+                tree.groups_count--;
+            }
+        } while (dir == NULL);
+    }
+
+out:
+    pool->current_dir = NULL;
+    // Every entry has to be retired before the directories are closed
+    scan_tree_reclaim(pool, 0);
+    pool->tree = NULL;
+    scan_slab_free(&tree.names);
+    scan_arena_free(&tree.arena);
+    return ret;
+}
+
+// What the scan allocates up front (see Memory)
+size_t scan_mem_fixed(const struct scan_config* config)
+{
+    size_t size = scan_pool_arena_size(config) + config->jobs * scan_worker_arena_size(config);
+
+    if (config->recursive)
+        size += scan_tree_arena_size(config);
+    return size;
+}
+
+// --max-mem: shrink the buffers allocated up front until they take at most half the budget, leaving the rest for
+// what grows with the scan. Smaller io_uring batches go first (fewer reads in flight at once), then a smaller
+// getdents64 buffer (more calls per directory)
+int scan_mem_plan(struct scan_config* config, const char* arg)
+{
+    size_t fixed;
+
+    while ((fixed = scan_mem_fixed(config)) > scan_mem.budget / 2) {
+        if (config->batch_size > SCAN_BATCH_SIZE)
+            config->batch_size /= 2;
+        else if (config->dir_buffer_size > SCAN_GETDENTS_MIN_BUFFER_SIZE)
+            config->dir_buffer_size /= 2;
+        else {
+            fprintf(stderr, "--max-mem=%s is too small for this scan, it needs at least %zu KiB\n", arg, (2 * fixed + 1023) / 1024);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+// Watch mode
+//
+// Instead of reading the source directory, inotify tells us about each file as soon as whoever wrote it closes it
+// (or it's renamed into the directory), so keys are classified and moved while VanityGPG is still generating them
+// Files already in the directory aren't looked at (that's what a normal scan is for)
+// Runs until SIGINT or SIGTERM, which are blocked in every thread and picked up through a signalfd so that the
+// keys already handed to the pipeline are still finished off properly
+
+#define SCAN_WATCH_BUFFER_SIZE (64 * 1024)
+
+// Blocked before any worker thread is started so they all inherit it
+void scan_watch_signals(sigset_t* out_set)
+{
+    sigemptyset(out_set);
+    sigaddset(out_set, SIGINT);
+    sigaddset(out_set, SIGTERM);
+}
+
+int scan_enumerate_watch(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    // inotify_event is aligned for its wd field
+    static _Alignas(struct inotify_event) char buf[SCAN_WATCH_BUFFER_SIZE];
+    struct pollfd fds[3];
+    sigset_t set;
+    int ret = 0;
+
+    scan_watch_signals(&set);
+
+    fds[0].fd = inotify_init1(IN_CLOEXEC);
+    fds[0].events = POLLIN;
+    fds[1].fd = signalfd(-1, &set, SFD_CLOEXEC);
+    fds[1].events = POLLIN;
+    // Ignored by poll if there's no --first
+    fds[2].fd = config->select != NULL ? config->select->wake_fd : -1;
+    fds[2].events = POLLIN;
+    if (fds[0].fd == -1 || fds[1].fd == -1) {
+        fprintf(stderr, "Failed to set up watch\n");
+        ret = 1;
+        goto out;
+    }
+
+    if (inotify_add_watch(fds[0].fd, config->source_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) == -1) {
+        fprintf(stderr, "Can't watch directory %s\n", config->source_dir);
+        ret = 1;
+        goto out;
+    }
+    fprintf(stderr, "Watching: %s\n", config->source_dir);
+
+    for (;;) {
+        ssize_t len;
+        char* p;
+
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to wait for watch events\n");
+            ret = 1;
+            break;
+        }
+
+        if ((fds[1].revents & POLLIN) || (fds[2].revents & POLLIN))
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        len = read(fds[0].fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            fprintf(stderr, "Failed to read watch events\n");
+            ret = 1;
+            break;
+        }
+
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                fprintf(stderr, "Watch events were lost, run a scan of %s to catch up\n", config->source_dir);
+            // The directory itself went away
+            if (event->mask & IN_IGNORED)
+                goto out;
+            if (event->len == 0 || (event->mask & IN_ISDIR))
+                continue;
+
+            // Closed after writing so it can't be empty unless it really is
+            scan_pool_add(pool, event->name, DT_REG, 0);
+        }
+
+        // Don't sit on a partial batch waiting for more keys
+        scan_pool_flush(pool);
+    }
+
+out:
+    if (fds[0].fd != -1)
+        close(fds[0].fd);
+    if (fds[1].fd != -1)
+        close(fds[1].fd);
+    return ret;
+}
+#endif
+
+// Keypacks
+//
+// Millions of tiny key files make metadata the bottleneck: every key costs an inode, a directory entry, an open and a
+// close. With --pack the source is one file holding all the keys instead, read in a single sequential pass (mapped
+// with MADV_SEQUENTIAL, or streamed through a buffer from a pipe) with the usual extractors run on each record in
+// place. Two containers are understood:
+//   keypack: "PGPKPACK" then for every key: name length (16-bit) | key length (32-bit) | name | key (big endian)
+//   tar: ustar/GNU/pax archives (e.g. tar cf keys.tar keys/), regular members only
+// Records go through the parallel scan like directory entries, each pointing at its key in the mapping so the
+// extractors work on the pack's pages directly with no copy. The kernel is asked to read a window ahead of the
+// enumerator (MADV_WILLNEED) on top of the sequential readahead. A record in the stream buffer is only valid until the
+// buffer is refilled, so a streamed pack is processed one record at a time by the enumerating thread
+// Compatible keys are extracted into the destination directory as files of their own (named after the last part of
+// their path) or, with --pack-output, appended to a keypack written in place of each destination directory
+// Nothing is ever removed from the source pack
+
+#define SCAN_PACK_MAGIC "PGPKPACK"
+#define SCAN_PACK_MAGIC_LEN 8
+// Keypack record header
+#define SCAN_PACK_RECORD_HEADER_LEN 6
+// Largest key in a streamed pack (anything bigger is reported and skipped)
+#define SCAN_PACK_MAX_RECORD (1024 * 1024)
+// Stream buffer, room for the largest record with its headers plus plenty to read ahead
+#define SCAN_PACK_BUFFER_SIZE (4 * SCAN_PACK_MAX_RECORD)
+#define SCAN_TAR_BLOCK_SIZE 512
+// How far ahead of the enumerator a mapped pack is read (a multiple of the page size)
+#define SCAN_PACK_WILLNEED_SIZE (16 * 1024 * 1024)
+
+enum scan_pack_format {
+    SCAN_PACK_KEYPACK,
+    SCAN_PACK_TAR
+};
+
+// A keypack being written (shared by every thread)
+struct scan_pack_writer {
+    int fd;
+    pthread_mutex_t lock;
+    size_t len;
+    unsigned char* data;
+};
+
+struct scan_pack {
+    int fd;
+    int format;
+    // The whole file if it's mapped, otherwise the stream buffer
+    const unsigned char* data;
+    size_t pos;
+    size_t len;
+    // NULL when mapped
+    unsigned char* buf;
+    void* map;
+    size_t map_size;
+    // End of what's been handed to MADV_WILLNEED so far
+    size_t willneed;
+    int read_failed;
+    // Bytes of the current record still to be stepped over
+    uint64_t advance;
+    // Name of the current record, and one from a GNU long name or pax header for the next tar member
+    char name[PATH_MAX + 1];
+    char next_name[PATH_MAX + 1];
+    // --pack-output: one writer per route (NULL when extracting into directories)
+    struct scan_pack_writer* writers;
+    size_t writers_count;
+};
+
+struct scan_pack_record {
+    const char* name;
+    const unsigned char* data;
+    size_t len;
+    // A streamed record over SCAN_PACK_MAX_RECORD so data is NULL
+    int too_large;
+};
+
+// Make n bytes available from the current position, NULL if the pack ends first
+const unsigned char* scan_pack_peek(struct scan_pack* pack, size_t n)
+{
+    while (pack->len - pack->pos < n) {
+        ssize_t got;
+
+        if (pack->buf == NULL || n > SCAN_PACK_BUFFER_SIZE)
+            return NULL;
+
+        // Keep what's left at the front of the buffer
+        memmove(pack->buf, pack->buf + pack->pos, pack->len - pack->pos);
+        pack->len -= pack->pos;
+        pack->pos = 0;
+
+        SCAN_STATS_TIME(start);
+        got = read(pack->fd, pack->buf + pack->len, SCAN_PACK_BUFFER_SIZE - pack->len);
+        SCAN_STATS_STAGE(SCAN_STAGE_READ, start);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            pack->read_failed |= got == -1;
+            return NULL;
+        }
+        pack->len += got;
+    }
+
+    return pack->data + pack->pos;
+}
+
+// Returns 0 unless the pack ends first
+int scan_pack_skip(struct scan_pack* pack, uint64_t n)
+{
+    while (n > 0) {
+        size_t step;
+
+        if (pack->pos == pack->len && scan_pack_peek(pack, 1) == NULL)
+            return 1;
+        step = pack->len - pack->pos < n ? pack->len - pack->pos : n;
+        pack->pos += step;
+        n -= step;
+    }
+
+    return 0;
+}
+
+int scan_pack_open(struct scan_pack* pack, int fd)
+{
+    const unsigned char* head;
+    struct stat stbuf;
+
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = fd;
+
+    if (fstat(fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode) && stbuf.st_size > 0) {
+        pack->map_size = stbuf.st_size;
+        pack->map = mmap(NULL, pack->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pack->map == MAP_FAILED)
+            pack->map = NULL;
+    }
+
+    if (pack->map != NULL) {
+        madvise(pack->map, pack->map_size, MADV_SEQUENTIAL);
+        pack->data = pack->map;
+        pack->len = pack->map_size;
+    }
+    else {
+        if ((pack->buf = scan_mem_alloc(SCAN_PACK_BUFFER_SIZE)) == NULL) {
+            fprintf(stderr, "Failed to allocate pack buffer\n");
+            return 1;
+        }
+        pack->data = pack->buf;
+    }
+
+    if ((head = scan_pack_peek(pack, SCAN_PACK_MAGIC_LEN)) != NULL && memcmp(head, SCAN_PACK_MAGIC, SCAN_PACK_MAGIC_LEN) == 0) {
+        pack->format = SCAN_PACK_KEYPACK;
+        pack->pos += SCAN_PACK_MAGIC_LEN;
+        return 0;
+    }
+    if ((head = scan_pack_peek(pack, SCAN_TAR_BLOCK_SIZE)) != NULL && memcmp(head + 257, "ustar", 5) == 0) {
+        pack->format = SCAN_PACK_TAR;
+        return 0;
+    }
+
+    fprintf(stderr, pack->read_failed ? "Failed to read pack\n" : "Not a keypack or tar archive\n");
+    return 1;
+}
+
+void scan_pack_close(struct scan_pack* pack)
+{
+    size_t i;
+
+    for (i = 0; i < pack->writers_count; i++) {
+        scan_mem_free(pack->writers[i].data);
+        pthread_mutex_destroy(&pack->writers[i].lock);
+    }
+    scan_mem_free(pack->writers);
+    if (pack->map != NULL)
+        munmap(pack->map, pack->map_size);
+    scan_mem_free(pack->buf);
+}
+
+// Octal (or GNU base-256 for big files) number field of a tar header
+uint64_t scan_tar_number(const unsigned char* field, size_t len)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    if (field[0] & 0x80) {
+        for (i = 1; i < len; i++)
+            value = value << 8 | field[i];
+        return value;
+    }
+
+    for (i = 0; i < len && field[i] == ' '; i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+// Copy a name that may not be NUL terminated (returns 1 if it's too long)
+int scan_pack_copy_name(char* out, const void* name, size_t len)
+{
+    const char* end = memchr(name, '\0', len);
+
+    if (end != NULL)
+        len = end - (const char*)name;
+    if (len > PATH_MAX)
+        return 1;
+    memcpy(out, name, len);
+    out[len] = '\0';
+    return 0;
+}
+
+// The "path" record of a pax extended header ("<length> <key>=<value>\n" records)
+void scan_tar_pax_path(struct scan_pack* pack, const unsigned char* data, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t record_len = 0;
+        size_t i;
+
+        for (i = pos; i < len && data[i] >= '0' && data[i] <= '9'; i++)
+            record_len = record_len * 10 + (data[i] - '0');
+        if (i == len || data[i] != ' ' || record_len == 0 || record_len > len - pos)
+            return;
+
+        // "path=" up to the newline that ends the record
+        if (record_len - (i + 1 - pos) > 6 && memcmp(data + i + 1, "path=", 5) == 0)
+            scan_pack_copy_name(pack->next_name, data + i + 6, pos + record_len - 1 - (i + 6));
+        pos += record_len;
+    }
+}
+
+// Returns 1 for a record, 0 at the end of the pack and -1 if it's corrupt or truncated (after saying so)
+int scan_pack_next_tar(struct scan_pack* pack, struct scan_pack_record* out_record)
+{
+    for (;;) {
+        const unsigned char* head = scan_pack_peek(pack, SCAN_TAR_BLOCK_SIZE);
+        uint64_t size;
+        uint64_t padded;
+        size_t i;
+        unsigned char type;
+
+        // Some writers leave out the end of archive blocks
+        if (head == NULL)
+            return pack->pos == pack->len && !pack->read_failed ? 0 : -1;
+        for (i = 0; i < SCAN_TAR_BLOCK_SIZE && head[i] == 0; i++)
+            ;
+        if (i == SCAN_TAR_BLOCK_SIZE)
+            return 0;
+        if (memcmp(head + 257, "ustar", 5) != 0) {
+            fprintf(stderr, "Corrupt tar header in pack\n");
+            return -1;
+        }
+
+        size = scan_tar_number(head + 124, 12);
+        padded = (size + SCAN_TAR_BLOCK_SIZE - 1) / SCAN_TAR_BLOCK_SIZE * SCAN_TAR_BLOCK_SIZE;
+        type = head[156];
+
+        // GNU long name or pax header for the next member
+        if (type == 'L' || type == 'x') {
+            const unsigned char* data = size <= SCAN_PACK_MAX_RECORD ? scan_pack_peek(pack, SCAN_TAR_BLOCK_SIZE + size) : NULL;
+
+            if (data != NULL && type == 'L')
+                scan_pack_copy_name(pack->next_name, data + SCAN_TAR_BLOCK_SIZE, size);
+            else if (data != NULL)
+                scan_tar_pax_path(pack, data + SCAN_TAR_BLOCK_SIZE, size);
+            if (scan_pack_skip(pack, SCAN_TAR_BLOCK_SIZE + padded) != 0)
+                return -1;
+            continue;
+        }
+
+        // Directories, links and the like
+        if (type != '0' && type != '\0' && type != '7') {
+            pack->next_name[0] = '\0';
+            if (scan_pack_skip(pack, SCAN_TAR_BLOCK_SIZE + padded) != 0)
+                return -1;
+            continue;
+        }
+
+        if (pack->next_name[0] != '\0') {
+            strcpy(pack->name, pack->next_name);
+            pack->next_name[0] = '\0';
+        }
+        else {
+            char name[101];
+
+            // POSIX ustar (not GNU) has the start of long paths in a prefix field
+            scan_pack_copy_name(name, head, 100);
+            pack->name[0] = '\0';
+            if (memcmp(head + 257, "ustar\0", 6) == 0 && head[345] != '\0') {
+                scan_pack_copy_name(pack->name, head + 345, 155);
+                strcat(pack->name, "/");
+            }
+            strcat(pack->name, name);
+        }
+
+        out_record->name = pack->name;
+        out_record->len = size;
+        out_record->too_large = pack->buf != NULL && size > SCAN_PACK_MAX_RECORD;
+        out_record->data = NULL;
+        if (!out_record->too_large) {
+            if ((head = scan_pack_peek(pack, SCAN_TAR_BLOCK_SIZE + size)) == NULL)
+                return -1;
+            out_record->data = head + SCAN_TAR_BLOCK_SIZE;
+        }
+        pack->advance = SCAN_TAR_BLOCK_SIZE + padded;
+        return 1;
+    }
+}
+
+int scan_pack_next_keypack(struct scan_pack* pack, struct scan_pack_record* out_record)
+{
+    const unsigned char* head;
+    size_t name_len;
+    uint32_t len;
+
+    if (scan_pack_peek(pack, 1) == NULL)
+        return pack->read_failed ? -1 : 0;
+    if ((head = scan_pack_peek(pack, SCAN_PACK_RECORD_HEADER_LEN)) == NULL)
+        return -1;
+    name_len = head[0] << 8 | head[1];
+    len = (uint32_t)head[2] << 24 | head[3] << 16 | head[4] << 8 | head[5];
+
+    if ((head = scan_pack_peek(pack, SCAN_PACK_RECORD_HEADER_LEN + name_len)) == NULL)
+        return -1;
+    if (name_len == 0 || scan_pack_copy_name(pack->name, head + SCAN_PACK_RECORD_HEADER_LEN, name_len) != 0) {
+        fprintf(stderr, "Corrupt record in pack\n");
+        return -1;
+    }
+
+    out_record->name = pack->name;
+    out_record->len = len;
+    out_record->too_large = pack->buf != NULL && len > SCAN_PACK_MAX_RECORD;
+    out_record->data = NULL;
+    if (!out_record->too_large) {
+        if ((head = scan_pack_peek(pack, SCAN_PACK_RECORD_HEADER_LEN + name_len + len)) == NULL)
+            return -1;
+        out_record->data = head + SCAN_PACK_RECORD_HEADER_LEN + name_len;
+    }
+    pack->advance = SCAN_PACK_RECORD_HEADER_LEN + name_len + (uint64_t)len;
+    return 1;
+}
+
+// The next key in the pack (its data is only valid until the next call)
+// Returns 1 for a record, 0 at the end of the pack and -1 if it's corrupt or truncated
+int scan_pack_next(struct scan_pack* pack, struct scan_pack_record* out_record)
+{
+    uint64_t advance = pack->advance;
+    int ret;
+
+    pack->advance = 0;
+    if (advance > 0 && scan_pack_skip(pack, advance) != 0)
+        ret = -1;
+    else if (pack->format == SCAN_PACK_TAR)
+        ret = scan_pack_next_tar(pack, out_record);
+    else
+        ret = scan_pack_next_keypack(pack, out_record);
+
+    if (ret == -1)
+        fprintf(stderr, pack->read_failed ? "Failed to read pack\n" : "Pack ends in the middle of a record\n");
+    return ret;
+}
+
+// --pack-output: start a keypack at the destination of each route
+int scan_pack_start_output(struct scan_pack* pack, const struct scan_config* config)
+{
+    size_t i;
+
+    pack->writers = scan_mem_calloc(config->filter.count, sizeof(*pack->writers));
+    if (pack->writers == NULL) {
+        fprintf(stderr, "Failed to allocate output buffers\n");
+        return 1;
+    }
+
+    for (i = 0; i < config->filter.count; i++) {
+        struct scan_pack_writer* writer = &pack->writers[i];
+
+        writer->fd = config->filter.routes[i].dest_fd;
+        pthread_mutex_init(&writer->lock, NULL);
+        pack->writers_count++;
+        if (writer->fd == -1)
+            continue;
+
+        if ((writer->data = scan_mem_alloc(SCAN_OUTPUT_BUFFER_SIZE)) == NULL) {
+            fprintf(stderr, "Failed to allocate output buffers\n");
+            return 1;
+        }
+        if (scan_index_write_all(writer->fd, SCAN_PACK_MAGIC, SCAN_PACK_MAGIC_LEN) != 0) {
+            fprintf(stderr, "Failed to write pack %s\n", config->filter.routes[i].dest_dir);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Write out what's left of each keypack and make sure it's on disk
+int scan_pack_finish_output(struct scan_pack* pack, const struct scan_config* config)
+{
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < pack->writers_count; i++) {
+        struct scan_pack_writer* writer = &pack->writers[i];
+
+        if (writer->data == NULL)
+            continue;
+        if (scan_index_write_all(writer->fd, writer->data, writer->len) != 0 || fsync(writer->fd) == -1) {
+            fprintf(stderr, "Failed to write pack %s\n", config->filter.routes[i].dest_dir);
+            ret = 1;
+        }
+        writer->len = 0;
+    }
+
+    return ret;
+}
+
+// Append a record to a keypack (through a buffer that's written out when full)
+int scan_pack_write_record(struct scan_pack_writer* writer, const char* name, const unsigned char* data, size_t len)
+{
+    size_t name_len = strlen(name);
+    unsigned char head[SCAN_PACK_RECORD_HEADER_LEN];
+    size_t total = SCAN_PACK_RECORD_HEADER_LEN + name_len + len;
+
+    if (name_len > UINT16_MAX || len > UINT32_MAX)
+        return 1;
+    head[0] = name_len >> 8;
+    head[1] = name_len;
+    head[2] = len >> 24;
+    head[3] = len >> 16;
+    head[4] = len >> 8;
+    head[5] = len;
+
+    if (SCAN_OUTPUT_BUFFER_SIZE - writer->len < total) {
+        if (scan_index_write_all(writer->fd, writer->data, writer->len) != 0)
+            return 1;
+        writer->len = 0;
+        if (total > SCAN_OUTPUT_BUFFER_SIZE)
+            return scan_index_write_all(writer->fd, head, sizeof(head)) != 0 || scan_index_write_all(writer->fd, name, name_len) != 0 ||
+                   scan_index_write_all(writer->fd, data, len) != 0;
+    }
+
+    memcpy(writer->data + writer->len, head, sizeof(head));
+    memcpy(writer->data + writer->len + sizeof(head), name, name_len);
+    memcpy(writer->data + writer->len + sizeof(head) + name_len, data, len);
+    writer->len += total;
+    return 0;
+}
+
+// Extract a compatible key into its destination directory as a new file
+int scan_pack_extract_file(int dirfd, const char* name, const unsigned char* data, size_t len)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int ret;
+
+    if (fd == -1)
+        return errno == EEXIST ? SCAN_MOVE_EXISTS : SCAN_MOVE_FAILED;
+
+    ret = scan_index_write_all(fd, data, len);
+    ret |= close(fd) == -1;
+    if (ret != 0) {
+        unlinkat(dirfd, name, 0);
+        return SCAN_MOVE_FAILED;
+    }
+    return SCAN_MOVE_DONE;
+}
+
+// SCAN_ACTION_EXTRACT: copy a compatible key out of the pack, returns a scan_move_status
+int scan_pack_extract(const struct scan_config* config, const struct scan_entry* entry)
+{
+    struct scan_pack* pack = config->pack;
+    int route = scan_filter_route(&config->filter, entry->timestamp);
+    int ret;
+
+    if (pack->writers == NULL)
+        return scan_pack_extract_file(config->filter.routes[route].dest_fd, scan_entry_dest_name(entry), entry->data, entry->size);
+
+    pthread_mutex_lock(&pack->writers[route].lock);
+    ret = scan_pack_write_record(&pack->writers[route], scan_entry_dest_name(entry), entry->data, entry->size);
+    pthread_mutex_unlock(&pack->writers[route].lock);
+    return ret == 0 ? SCAN_MOVE_DONE : SCAN_MOVE_FAILED;
+}
+
+// Hand every key in the pack to the pipeline
+int scan_enumerate_pack(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_pack* pack = config->pack;
+    struct scan_pack_record record;
+    int next;
+
+    while (!scan_select_done(config) && (next = scan_pack_next(pack, &record)) != 0) {
+        struct scan_slot* slot;
+        const char* base;
+        size_t name_len;
+
+        if (next == -1)
+            return 1;
+
+        // Hidden files get the same treatment as in a directory
+        base = strrchr(record.name, '/');
+        if (!scan_dirent_wanted(base != NULL ? base + 1 : record.name, DT_REG) || !scan_shard_wanted(config, "", record.name))
+            continue;
+
+        name_len = strlen(record.name);
+        if (name_len > NAME_MAX) {
+            fprintf(stderr, "File name too long: %s/%s\n", config->source_dir, record.name);
+            continue;
+        }
+
+        if (pack->map != NULL && pack->pos + SCAN_PACK_WILLNEED_SIZE / 2 > pack->willneed && pack->willneed < pack->map_size) {
+            size_t len = pack->map_size - pack->willneed < SCAN_PACK_WILLNEED_SIZE ? pack->map_size - pack->willneed : SCAN_PACK_WILLNEED_SIZE;
+
+            madvise((char*)pack->map + pack->willneed, len, MADV_WILLNEED);
+            pack->willneed += len;
+        }
+
+        slot = scan_pool_reserve(pool);
+        memcpy(slot->name, record.name, name_len + 1);
+        slot->entry.name = slot->name;
+        slot->entry.dir = NULL;
+        slot->entry.d_type = DT_REG;
+        slot->entry.ino = 0;
+        slot->entry.data = record.data;
+        slot->entry.size = record.len;
+        scan_pool_push(pool);
+    }
+
+    return 0;
+}
+
+int scan_pool_run(struct scan_pool* pool, DIR* dir, int files_from_fd)
+{
+    int ret;
+
+    ret = scan_pool_start(pool);
+    // Before anything else is reported
+    if (ret == 0 && pool->config->checkpoint != NULL)
+        ret = scan_checkpoint_replay(pool);
+#ifdef __linux__
+    if (ret == 0 && pool->config->watch)
+        ret = scan_enumerate_watch(pool);
+    else
+#endif
+    if (ret == 0 && pool->config->pack != NULL)
+        ret = scan_enumerate_pack(pool);
+    else if (ret == 0 && files_from_fd != -1)
+        ret = scan_enumerate_files_from(pool, files_from_fd);
+    else if (ret == 0 && pool->config->recursive)
+        ret = scan_enumerate_tree(pool);
+    else if (ret == 0) {
+#ifdef __linux__
+        if (pool->config->checkpoint != NULL && pool->config->checkpoint->resuming)
+            ret = scan_checkpoint_seek(pool, dirfd(dir));
+        if (ret == 0)
+            ret = scan_enumerate_getdents(pool, dirfd(dir));
+#else
+        ret = scan_enumerate_readdir(pool, dir);
+#endif
+    }
+    scan_pool_finish(pool);
+
+    return ret;
+}
+
+// --closest: merge the threads' candidates and act on (and report) the best of them now that the scan is over
+int scan_select_finish(struct scan_pool* pool)
+{
+    const struct scan_config* config = pool->config;
+    struct scan_buffers* buffers = &pool->workers[0].buffers;
+    struct scan_candidate* candidates;
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < pool->workers_count; i++)
+        count += pool->workers[i].buffers.candidates.count;
+
+    candidates = scan_mem_alloc(count * sizeof(*candidates) + 1);
+    if (candidates == NULL) {
+        fprintf(stderr, "Failed to allocate candidates\n");
+        return 1;
+    }
+    count = 0;
+    for (i = 0; i < pool->workers_count; i++) {
+        const struct scan_candidates* worker_candidates = &pool->workers[i].buffers.candidates;
+        memcpy(candidates + count, worker_candidates->heap, worker_candidates->count * sizeof(*candidates));
+        count += worker_candidates->count;
+    }
+    qsort(candidates, count, sizeof(*candidates), scan_candidate_sort_compare);
+
+    // Closest first
+    for (i = 0; i < count && i < config->select->limit; i++) {
+        struct scan_entry entry = { 0 };
+
+        entry.name = candidates[i].path;
+        entry.d_type = DT_REG;
+        entry.status = SCAN_EXTRACTED;
+        entry.extract_status = PGP_KEY_OK;
+        entry.timestamp = candidates[i].timestamp;
+        entry.move_status = -1;
+
+        if (scan_entry_wants_action(config, &entry)) {
+            scan_act_entry(config, buffers, &entry);
+            // A copy to another file system has to be finished before its entry goes away
+            scan_move_flush(&buffers->mover);
+        }
+        if (config->index != NULL && config->action == SCAN_ACTION_MOVE && entry.move_status == SCAN_MOVE_DONE)
+            scan_index_remove(config->index, entry.name);
+        scan_report_match(config, &pool->output, &entry);
+    }
+    scan_output_flush(&pool->output);
+
+    // The paths still belong to the threads' heaps
+    scan_mem_free(candidates);
+    return 0;
+}
+
+// Query mode
+//
+// Answers straight from a timestamp index (see above) without reading the source directory or any key in it
+// Each query is one binary search for the first compatible record and every record after it is compatible too,
+// so it's O(log n) plus the size of the output however many keys there are
+// Keys are moved from the source directory only if a destination is given (the index is then updated to match)
+
+// A query is either a PGP key file or a raw timestamp (only digits, use ./NAME for a key file named like that)
+int timestamp_arg_is_number(const char* arg)
+{
+    return arg[0] != '\0' && strspn(arg, "0123456789") == strlen(arg);
+}
+
+// A raw timestamp or the path of a key file to take the creation timestamp of (buf as for pgp_key_extract_timestamp)
+int timestamp_arg_parse(const char* arg, unsigned char* buf, unsigned int* out_timestamp)
+{
+    int ret;
+
+    if (timestamp_arg_is_number(arg)) {
+        unsigned long timestamp;
+
+        errno = 0;
+        timestamp = strtoul(arg, NULL, 10);
+        if (errno != 0 || timestamp > UINT_MAX) {
+            fprintf(stderr, "Invalid timestamp: %s\n", arg);
+            return 1;
+        }
+        *out_timestamp = timestamp;
+        return 0;
+    }
+
+    ret = pgp_key_extract_timestamp(AT_FDCWD, arg, buf, out_timestamp);
+    if (ret != PGP_KEY_OK) {
+        fprintf(stderr, "%s: %s\n", pgp_key_strerror(ret), arg);
+        return 1;
+    }
+    return 0;
+}
+
+int query_parse(const char* arg, unsigned char* buf, unsigned int* out_timestamp)
+{
+    if (timestamp_arg_parse(arg, buf, out_timestamp) != 0)
+        return 1;
+
+    if (timestamp_arg_is_number(arg))
+        fprintf(stderr, "Timestamp query: %u\n", *out_timestamp);
+    else
+        fprintf(stderr, "Primary PGP key timestamp: %u (%s)\n", *out_timestamp, arg);
+    return 0;
+}
+
+int scan_route_compare(const void* a, const void* b)
+{
+    const struct scan_route* x = a;
+    const struct scan_route* y = b;
+
+    if (x->timestamp != y->timestamp)
+        return (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// Take the timestamps of the --primary keys (routes with a key) and --min/--max, sort the routes and narrow the range
+int scan_filter_compile(struct scan_filter* filter, const char* min_arg, const char* max_arg)
+{
+    unsigned char* buf;
+    size_t i;
+    int ret = 0;
+
+    buf = malloc(PGP_KEY_HEADER_MAX_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        return 1;
+    }
+
+    filter->min = 0;
+    filter->max = UINT_MAX;
+    if (min_arg != NULL)
+        ret |= timestamp_arg_parse(min_arg, buf, &filter->min);
+    if (max_arg != NULL)
+        ret |= timestamp_arg_parse(max_arg, buf, &filter->max);
+
+    for (i = 0; i < filter->count; i++) {
+        struct scan_route* route = &filter->routes[i];
+
+        if (route->key == NULL)
+            continue;
+        if (timestamp_arg_parse(route->key, buf, &route->timestamp) != 0) {
+            ret = 1;
+            continue;
+        }
+        if (timestamp_arg_is_number(route->key))
+            fprintf(stderr, "Primary timestamp: %u\n", route->timestamp);
+        else
+            fprintf(stderr, "Primary PGP key timestamp: %u (%s)\n", route->timestamp, route->key);
+    }
+    free(buf);
+    if (ret != 0)
+        return 1;
+
+    // Only --min/--max so every key in range is compatible (and reported)
+    if (filter->count == 0) {
+        filter->routes[0].key = NULL;
+        filter->routes[0].timestamp = 0;
+        filter->routes[0].dest_dir = NULL;
+        filter->routes[0].dest_fd = -1;
+        filter->routes[0].order = 0;
+        filter->count = 1;
+    }
+
+    qsort(filter->routes, filter->count, sizeof(*filter->routes), scan_route_compare);
+    if (filter->min < filter->routes[0].timestamp)
+        filter->min = filter->routes[0].timestamp;
+
+    if (min_arg != NULL || max_arg != NULL)
+        fprintf(stderr, "Timestamp range: %u to %u\n", filter->min, filter->max);
+    if (filter->min > filter->max) {
+        fprintf(stderr, "The timestamp range is empty (--max is before --min or the earliest primary key)\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int query_move(const struct scan_config* config, struct scan_index* index, size_t first)
+{
+    struct scan_buffers buffers;
+    struct scan_arena arena;
+    size_t i;
+
+    if (scan_arena_init(&arena, scan_buffers_size(config)) != 0) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        return 1;
+    }
+    if (scan_buffers_init(&buffers, config, &arena) != 0) {
+        scan_arena_free(&arena);
+        return 1;
+    }
+
+    for (i = 0; i < index->count; i++) {
+        const struct scan_index_record* record = &index->records[i];
+        const char* name = index->names + record->name;
+
+        if (record->name >= index->names_size)
+            continue;
+
+        if (i >= first) {
+            int status;
+            int copy_status;
+
+            fprintf(stderr, "Moving compatible PGP subkey: %s/%s\n", config->source_dir, name);
+            status = scan_move_rename(config->source_dirfd, name, config->dest_dirfd, name);
+            // Copies are finished one at a time here as the index needs to know if each one worked
+            if (status == SCAN_MOVE_CROSS_DEVICE) {
+                status = scan_move_copy(&buffers.mover, buffers.key, PGP_KEY_HEADER_MAX_SIZE, config->source_dirfd, name,
+                                        config->dest_dirfd, name, &copy_status);
+                if (status == SCAN_MOVE_DONE) {
+                    scan_move_flush(&buffers.mover);
+                    status = copy_status;
+                }
+            }
+            if (status == SCAN_MOVE_DONE)
+                continue;
+            fprintf(stderr, "Failed to move PGP key file%s: %s/%s\n", status == SCAN_MOVE_EXISTS ? " (already in destination)" : "",
+                    config->source_dir, name);
+        }
+
+        scan_index_add_record(index, record, name);
+    }
+
+    scan_buffers_free(&buffers);
+    scan_arena_free(&arena);
+    return scan_index_write(index);
+}
+
+int query_run(struct scan_config* config, struct scan_index* index, char** queries, int queries_count)
+{
+    unsigned char* buf;
+    // Moving the keys compatible with any query means moving those of the oldest one
+    size_t move_first = index->count;
+    int ret = 0;
+    int i;
+
+    buf = malloc(PGP_KEY_HEADER_MAX_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        return 1;
+    }
+
+    for (i = 0; i < queries_count; i++) {
+        size_t first;
+        size_t j;
+
+        if (query_parse(queries[i], buf, &config->timestamp_query) != 0) {
+            ret = 1;
+            continue;
+        }
+
+        first = scan_index_lower_bound(index, config->timestamp_query);
+        for (j = first; j < index->count; j++) {
+            if (index->records[j].name < index->names_size)
+                printf("%s/%s\n", config->source_dir, index->names + index->records[j].name);
+        }
+        fprintf(stderr, "Compatible PGP subkeys: %zu\n", index->count - first);
+
+        if (first < move_first)
+            move_first = first;
+    }
+    free(buf);
+
+    if (ret == 0 && config->match) {
+        fflush(stdout);
+        ret = query_move(config, index, move_first);
+    }
+
+    return ret;
+}
+
+void print_query_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s query [OPTIONS] <SOURCE_DIRECTORY> <PRIMARY_PGP_KEY|TIMESTAMP>...\n\n"
+
+                    "Prints the keys in the source directory compatible with each primary PGP key (or raw creation\n"
+                    "timestamp) according to its timestamp index, as saved by a scan with --index. No key files are\n"
+                    "read so run a scan with --index first if keys may have been added since.\n\n"
+
+                    "Options:\n"
+                    "      --index=FILE Timestamp index to use (default: " SCAN_INDEX_NAME " in the source directory)\n"
+                    "      --move=DIR   Also move the keys compatible with any of the queries to DIR\n", progname);
+}
+
+enum {
+    OPT_QUERY_INDEX = 256,
+    OPT_QUERY_MOVE
+};
+
+int query_main(const char* progname, int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "index", required_argument, NULL, OPT_QUERY_INDEX },
+        { "move", required_argument, NULL, OPT_QUERY_MOVE },
+        { NULL, 0, NULL, 0 }
+    };
+    struct scan_config config = { 0 };
+    struct scan_index index;
+    const char* index_path = NULL;
+    int opt;
+    int ret;
+
+    config.dest_dirfd = -1;
+    config.manifest_fd = -1;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_QUERY_INDEX:
+            index_path = optarg;
+            break;
+        case OPT_QUERY_MOVE:
+            config.match = 1;
+            config.dest_dir = optarg;
+            break;
+        default:
+            print_query_usage(progname);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        print_query_usage(progname);
+        return 1;
+    }
+    config.source_dir = argv[optind];
+
+    if ((config.source_dirfd = open(config.source_dir, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "Can't open directory %s\n", config.source_dir);
+        return 1;
+    }
+
+    if (config.match && (config.dest_dirfd = open(config.dest_dir, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "Can't open directory %s\n", config.dest_dir);
+        close(config.source_dirfd);
+        return 1;
+    }
+
+    if (index_path != NULL)
+        ret = scan_index_open(&index, AT_FDCWD, index_path);
+    else
+        ret = scan_index_open(&index, config.source_dirfd, SCAN_INDEX_NAME);
+
+    if (ret == 0 && index.map == NULL) {
+        fprintf(stderr, "No usable timestamp index for %s (run a scan with --index first)\n", config.source_dir);
+        ret = 1;
+    }
+    if (ret == 0)
+        ret = query_run(&config, &index, argv + optind + 1, argc - optind - 1);
+
+    scan_index_close(&index);
+    close(config.source_dirfd);
+    if (config.match)
+        close(config.dest_dirfd);
+    return ret;
+}
+
+// Filter mode
+//
+// Sits in the pipeline between the key generator and the disk: reads a stream of concatenated raw or armored keys
+// from stdin and passes on only the compatible ones, to stdout just as they came in or into a directory as a file
+// each (named after the timestamp plus .asc or .gpg). Everything else is dropped without ever touching the disk
+// Keys are cut out of the stream buffer with pgp_ts_key_len. A raw key only ends where the next one starts, so the
+// last one in the buffer waits for more of the stream (or its end). Whatever was let through is written out before
+// every read, so keys come out as soon as the generator lets go of them
+// Anything that isn't a key is reported once and skipped up to the next armored key
+
+// Room for the largest key with plenty to read ahead
+#define FILTER_BUFFER_SIZE (4 * 1024 * 1024)
+#define FILTER_ARMOR_BEGIN "-----BEGIN PGP "
+
+struct filter_state {
+    struct scan_filter filter;
+    // -1 to write compatible keys to stdout
+    int dest_fd;
+    const char* dest_dir;
+    int quiet;
+    // Compatible keys for stdout and the lines reporting them, written out before every read
+    struct scan_output_buffer out;
+    struct scan_output_buffer err;
+    size_t keys;
+    size_t compatible;
+    size_t failed;
+    // In the middle of something that isn't a key (so it's only reported once)
+    int skipping;
+};
+
+// A line for stderr (without a syscall per key)
+void filter_report(struct filter_state* state, const char* fmt, ...)
+{
+    char line[PATH_MAX + 128];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len > 0) {
+        scan_output_write(&state->err, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+        scan_output_end(&state->err);
+    }
+}
+
+int filter_output_flush(struct filter_state* state)
+{
+    int ret = scan_index_write_all(state->out.fd, state->out.data, state->out.len);
+
+    state->out.len = 0;
+    if (ret != 0) {
+        scan_output_flush_buffer(&state->err);
+        fprintf(stderr, "Failed to write to stdout\n");
+    }
+    return ret;
+}
+
+int filter_output(struct filter_state* state, const unsigned char* key, size_t len)
+{
+    if (SCAN_OUTPUT_BUFFER_SIZE - state->out.len < len) {
+        if (filter_output_flush(state) != 0)
+            return 1;
+        if (len > SCAN_OUTPUT_BUFFER_SIZE)
+            return scan_index_write_all(state->out.fd, key, len);
+    }
+
+    memcpy(state->out.data + state->out.len, key, len);
+    state->out.len += len;
+    return 0;
+}
+
+// A new file for a compatible key, with a number after the timestamp if there's already one of that name
+int filter_write_file(struct filter_state* state, unsigned int timestamp, int armored, const unsigned char* key, size_t len)
+{
+    const char* ext = armored ? "asc" : "gpg";
+    char name[64];
+    unsigned int i;
+    int status = SCAN_MOVE_EXISTS;
+
+    for (i = 0; status == SCAN_MOVE_EXISTS && i < 1000; i++) {
+        if (i == 0)
+            snprintf(name, sizeof(name), "%u.%s", timestamp, ext);
+        else
+            snprintf(name, sizeof(name), "%u-%u.%s", timestamp, i, ext);
+        status = scan_pack_extract_file(state->dest_fd, name, key, len);
+    }
+
+    if (status != SCAN_MOVE_DONE) {
+        filter_report(state, "Failed to write PGP key file: %s/%s\n", state->dest_dir, name);
+        return 1;
+    }
+    if (!state->quiet)
+        filter_report(state, "Compatible PGP subkey: %s/%s\n", state->dest_dir, name);
+    return 0;
+}
+
+int filter_key(struct filter_state* state, const unsigned char* key, size_t len)
+{
+    unsigned int timestamp;
+    int ret;
+
+    state->keys++;
+    ret = pgp_key_extract_timestamp_buf(key, len, &timestamp);
+    if (ret != PGP_KEY_OK) {
+        filter_report(state, "%s: key %zu of the stream\n", pgp_key_strerror(ret), state->keys);
+        state->failed++;
+        return 0;
+    }
+    if (scan_filter_route(&state->filter, timestamp) == -1)
+        return 0;
+
+    state->compatible++;
+    if (state->dest_fd != -1)
+        return filter_write_file(state, timestamp, key[0] == '-', key, len);
+
+    if (!state->quiet)
+        filter_report(state, "Compatible PGP subkey: key %zu of the stream (timestamp %u)\n", state->keys, timestamp);
+    return filter_output(state, key, len);
+}
+
+// Where to pick up again after something that isn't a key: the next armored key (or as close to the end as one
+// could start)
+size_t filter_resync(const unsigned char* buf, size_t start, size_t end)
+{
+    size_t pos;
+
+    for (pos = start + 1; pos < end; pos++) {
+        const unsigned char* dash = memchr(buf + pos, '-', end - pos);
+        size_t left;
+
+        if (dash == NULL)
+            return end;
+        pos = dash - buf;
+        left = end - pos;
+        if (memcmp(buf + pos, FILTER_ARMOR_BEGIN, left < sizeof(FILTER_ARMOR_BEGIN) - 1 ? left : sizeof(FILTER_ARMOR_BEGIN) - 1) == 0)
+            return pos;
+    }
+
+    return end;
+}
+
+int filter_run(struct filter_state* state, unsigned char* buf)
+{
+    size_t start = 0;
+    size_t end = 0;
+    size_t key_len;
+    ssize_t len;
+    int final = 0;
+    int ret = 0;
+
+    for (;;) {
+        while (ret == 0 && start < end) {
+            // Blank lines between armored keys
+            if (buf[start] == '\n' || buf[start] == '\r' || buf[start] == ' ' || buf[start] == '\t') {
+                start++;
+                continue;
+            }
+
+            int status = pgp_ts_key_len(buf + start, end - start, final, &key_len);
+            if (status == PGP_TS_ERR_SHORT)
+                break;
+            if (status != PGP_TS_OK) {
+                // Only the last key can be cut off
+                if (status != PGP_TS_ERR_PACKET) {
+                    state->keys++;
+                    state->failed++;
+                    filter_report(state, "Truncated PGP key: key %zu of the stream\n", state->keys);
+                }
+                else if (!state->skipping)
+                    filter_report(state, "Not a PGP key, skipping stream data after key %zu\n", state->keys);
+                state->skipping = 1;
+                start = filter_resync(buf, start, end);
+                continue;
+            }
+
+            state->skipping = 0;
+            ret = filter_key(state, buf + start, key_len);
+            start += key_len;
+        }
+
+        if (ret == 0 && state->dest_fd == -1)
+            ret = filter_output_flush(state);
+        scan_output_flush_buffer(&state->err);
+        if (ret != 0 || final)
+            break;
+
+        // Keep what's left of the stream at the front of the buffer
+        memmove(buf, buf + start, end - start);
+        end -= start;
+        start = 0;
+        if (end == FILTER_BUFFER_SIZE) {
+            fprintf(stderr, "Key too large (%d bytes or more) after key %zu of the stream\n", FILTER_BUFFER_SIZE, state->keys);
+            ret = 1;
+            break;
+        }
+
+        len = read(STDIN_FILENO, buf + end, FILTER_BUFFER_SIZE - end);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1) {
+            fprintf(stderr, "Failed to read from stdin\n");
+            ret = 1;
+            break;
+        }
+        final = len == 0;
+        end += len;
+    }
+
+    if (!state->quiet)
+        fprintf(stderr, "Filtered %zu keys: %zu compatible, %zu dropped, %zu failed\n", state->keys, state->compatible,
+                state->keys - state->compatible - state->failed, state->failed);
+    return ret;
+}
+
+void print_filter_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s filter [OPTIONS] <PRIMARY_PGP_KEY|TIMESTAMP> [<DESTINATION_DIRECTORY>]\n\n"
+
+                    "Reads a stream of concatenated raw or ASCII-armored PGP keys (e.g. from a key generator) from stdin\n"
+                    "and passes on only those compatible with the primary PGP key (or raw creation timestamp): to stdout\n"
+                    "as they came in, or into the destination directory as a file each named after its timestamp.\n\n"
+
+                    "Options:\n"
+                    "  -q, --quiet      Only report errors\n"
+                    "      --format=TOOL\n"
+                    "                   Which tool generated the keys: auto (default), vanitygpg, gnupg or sequoia\n"
+                    "      --min=KEY    Only keys created at or after KEY's timestamp (or a timestamp)\n"
+                    "      --max=KEY    Only keys created at or before KEY's timestamp (or a timestamp)\n", progname);
+}
+
+enum {
+    OPT_FILTER_MIN = 256,
+    OPT_FILTER_MAX,
+    OPT_FILTER_FORMAT
+};
+
+// --format for the scan and filter
+int key_format_parse(const char* arg)
+{
+    int format = pgp_ts_format_parse(arg);
+
+    if (format == -1) {
+        fprintf(stderr, "Invalid key format: %s\n", arg);
+        return 1;
+    }
+    pgp_key_format = format;
+    return 0;
+}
+
+int filter_main(const char* progname, int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "quiet", no_argument, NULL, 'q' },
+        { "min", required_argument, NULL, OPT_FILTER_MIN },
+        { "max", required_argument, NULL, OPT_FILTER_MAX },
+        { "format", required_argument, NULL, OPT_FILTER_FORMAT },
+        { NULL, 0, NULL, 0 }
+    };
+    struct filter_state state = { 0 };
+    const char* min_arg = NULL;
+    const char* max_arg = NULL;
+    unsigned char* buf;
+    int opt;
+    int ret;
+
+    state.dest_fd = -1;
+    state.out.fd = STDOUT_FILENO;
+    state.err.fd = STDERR_FILENO;
+
+    while ((opt = getopt_long(argc, argv, "q", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'q':
+            state.quiet = 1;
+            break;
+        case OPT_FILTER_MIN:
+            min_arg = optarg;
+            break;
+        case OPT_FILTER_MAX:
+            max_arg = optarg;
+            break;
+        case OPT_FILTER_FORMAT:
+            if (key_format_parse(optarg) != 0)
+                return 1;
+            break;
+        default:
+            print_filter_usage(progname);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2) {
+        print_filter_usage(progname);
+        return 1;
+    }
+
+    state.filter.routes[0].key = argv[optind];
+    state.filter.routes[0].dest_dir = NULL;
+    state.filter.routes[0].dest_fd = -1;
+    state.filter.routes[0].order = 0;
+    state.filter.count = 1;
+    if (scan_filter_compile(&state.filter, min_arg, max_arg) != 0)
+        return 1;
+
+    if (argc - optind == 2) {
+        state.dest_dir = argv[optind + 1];
+        if ((state.dest_fd = open(state.dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "Can't open directory %s\n", state.dest_dir);
+            return 1;
+        }
+    }
+
+    buf = malloc(FILTER_BUFFER_SIZE);
+    state.out.data = malloc(SCAN_OUTPUT_BUFFER_SIZE);
+    state.err.data = malloc(SCAN_OUTPUT_BUFFER_SIZE);
+    if (buf == NULL || state.out.data == NULL || state.err.data == NULL) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        ret = 1;
+    }
+    else
+        ret = filter_run(&state, buf);
+
+    free(buf);
+    free(state.out.data);
+    free(state.err.data);
+    if (state.dest_fd != -1)
+        close(state.dest_fd);
+    return ret;
+}
+
+// Merge mode
+//
+// Puts the manifests of a sharded scan (see --shard) back together: every key listed in them, sorted by timestamp
+// (then path) with duplicates dropped and narrowed down with the same --primary/--min/--max query a scan takes
+// The result is a manifest again (text with timestamps or binary) so merges can be merged in turn
+// A manifest is mapped and each key points straight into the mapping, so the only copy is the sort of the keys
+// Binary manifests say which shard they are, so if every manifest does, a missing (or doubled up) shard is reported
+
+// Most shards a tree can be split into
+#define SCAN_SHARD_MAX 65536
+
+struct merge_key {
+    const char* path;
+    size_t path_len;
+    unsigned int timestamp;
+};
+
+struct merge_mapping {
+    void* map;
+    size_t size;
+    // Read into memory (from a pipe) rather than mapped
+    int read;
+};
+
+struct merge_state {
+    // Only the keys that pass the query (if there is one) are kept and sorted
+    const struct scan_filter* filter;
+    size_t read;
+    struct merge_key* keys;
+    size_t count;
+    size_t capacity;
+    struct merge_mapping* mappings;
+    int mappings_count;
+    // From the binary manifests (0 until the first one), shards_seen counts each shard index
+    unsigned int shard_count;
+    unsigned int* shards_seen;
+    int shard_counts_differ;
+    // A manifest that doesn't say which shards it has (text or a partial merge)
+    int shards_unknown;
+    struct scan_output_buffer out;
+    int binary;
+};
+
+int merge_add(struct merge_state* state, const char* path, size_t path_len, unsigned int timestamp)
+{
+    state->read++;
+    if (state->filter != NULL && scan_filter_route(state->filter, timestamp) == -1)
+        return 0;
+
+    if (state->count == state->capacity) {
+        size_t capacity = state->capacity ? state->capacity * 2 : 65536;
+        struct merge_key* keys = realloc(state->keys, capacity * sizeof(*keys));
+
+        if (keys == NULL) {
+            fprintf(stderr, "Failed to allocate key list\n");
+            return 1;
+        }
+        state->keys = keys;
+        state->capacity = capacity;
+    }
+
+    state->keys[state->count].path = path;
+    state->keys[state->count].path_len = path_len;
+    state->keys[state->count].timestamp = timestamp;
+    state->count++;
+    return 0;
+}
+
+// path TAB timestamp per line (a path may have tabs of its own, the timestamp is after the last one)
+int merge_load_text(struct merge_state* state, const char* name, const char* map, size_t size)
+{
+    const char* end = map + size;
+    const char* line;
+    const char* next;
+    size_t line_number = 0;
+
+    for (line = map; line < end; line = next + 1) {
+        const char* tab;
+        const char* p;
+        unsigned long long timestamp = 0;
+
+        next = memchr(line, '\n', end - line);
+        if (next == NULL)
+            next = end;
+        line_number++;
+        if (next == line)
+            continue;
+
+        // Backwards by hand since memrchr is a GNU extension
+        for (tab = next - 1; tab > line && *tab != '\t'; tab--)
+            ;
+        if (tab == line || tab + 1 == next) {
+            fprintf(stderr, "No path and timestamp on line %zu of manifest %s (write it with --manifest-timestamps)\n",
+                    line_number, name);
+            return 1;
+        }
+        for (p = tab + 1; p < next && *p >= '0' && *p <= '9' && timestamp <= UINT_MAX; p++)
+            timestamp = timestamp * 10 + (*p - '0');
+        if (p != next || timestamp > UINT_MAX) {
+            fprintf(stderr, "Invalid timestamp on line %zu of manifest %s\n", line_number, name);
+            return 1;
+        }
+
+        if (merge_add(state, line, tab - line, timestamp) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int merge_note_shard(struct merge_state* state, unsigned int shard_index, unsigned int shard_count)
+{
+    if (state->shard_count == 0) {
+        state->shards_seen = calloc(shard_count, sizeof(*state->shards_seen));
+        if (state->shards_seen == NULL) {
+            fprintf(stderr, "Failed to allocate shard list\n");
+            return 1;
+        }
+        state->shard_count = shard_count;
+    }
+
+    if (shard_count != state->shard_count)
+        state->shard_counts_differ = 1;
+    else
+        state->shards_seen[shard_index]++;
+    return 0;
+}
+
+int merge_load_binary(struct merge_state* state, const char* name, const char* map, size_t size)
+{
+    struct scan_manifest_header header;
+    size_t pos = sizeof(header);
+    unsigned int shard_index;
+    unsigned int shard_count;
+
+    memcpy(&header, map, sizeof(header));
+    shard_index = ntohl(header.shard_index);
+    shard_count = ntohl(header.shard_count);
+    if (shard_count > SCAN_SHARD_MAX || (shard_count > 0 ? shard_index >= shard_count : shard_index != 0)) {
+        fprintf(stderr, "Invalid shard in manifest %s\n", name);
+        return 1;
+    }
+
+    if (shard_count == 0)
+        state->shards_unknown = 1;
+    else if (merge_note_shard(state, shard_index, shard_count) != 0)
+        return 1;
 
-int pgp_key_raw_extract_timestamp(FILE* file, unsigned int* out_timestamp)
-{
-    if (fseek(file, 3, SEEK_SET) == 0) {
-        if (fread(out_timestamp, 1, sizeof(*out_timestamp), file) < sizeof(*out_timestamp))
+    while (pos < size) {
+        struct scan_output_record record;
+        size_t name_len;
+
+        if (size - pos < sizeof(record)) {
+            fprintf(stderr, "Truncated manifest %s\n", name);
+            return 1;
+        }
+        memcpy(&record, map + pos, sizeof(record));
+        pos += sizeof(record);
+        name_len = ntohs(record.name_len);
+        if (size - pos < name_len) {
+            fprintf(stderr, "Truncated manifest %s\n", name);
+            return 1;
+        }
+
+        if (record.status == PGP_KEY_OK && name_len > 0 && merge_add(state, map + pos, name_len, ntohl(record.timestamp)) != 0)
             return 1;
+        pos += name_len;
     }
-    else
-        return 1;
 
     return 0;
 }
 
-int pgp_key_dearmor_extract_timestamp(FILE* file, unsigned int* out_timestamp) {
-    // 64 (length of ASCII key line + 1 (newline) + 1 (validate string isn't too long) + 1 (null byte)
-    char line[67];
-    char* timestamp_base64_pos;
-    gint state = 0;
-    guint save = 0;
+// A manifest that isn't a regular file (e.g. piped in from another host) is read into memory instead of mapped
+int merge_read(struct merge_mapping* mapping, int fd)
+{
+    size_t capacity = 0;
+    ssize_t len;
 
-    while(fgets(line, sizeof(line), file)) {
-        // Ignore:
-        // -----BEGIN/END PGP PRIVATE/PUBLIC KEY BLOCK-----
-        // AND
-        // "Comment:", "Version:", etc.
-        if (strchr(line, '-') || strchr(line, ':')) {
-            continue;
-        }
+    mapping->map = NULL;
+    mapping->size = 0;
+    mapping->read = 1;
+    for (;;) {
+        if (mapping->size == capacity) {
+            void* map;
 
-        // Search for line with length of 64 (+1 for newline)
-        // For GnuPG and Sequoia PGP at least, this is the length for one line of an ASCII-armored PGP key
-        if (strlen(line) != sizeof(line) - 2) {
-            continue;
+            capacity = capacity ? capacity * 2 : SCAN_OUTPUT_BUFFER_SIZE;
+            if ((map = realloc(mapping->map, capacity)) == NULL)
+                return 1;
+            mapping->map = map;
         }
+        len = read(fd, (char*)mapping->map + mapping->size, capacity - mapping->size);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return len == -1;
+        mapping->size += len;
+    }
+}
+
+// name is - for stdin
+int merge_load(struct merge_state* state, const char* name)
+{
+    struct merge_mapping* mapping = &state->mappings[state->mappings_count];
+    int is_stdin = strcmp(name, "-") == 0;
+    struct stat stbuf;
+    int fd;
 
-        // Seek to timestamp in base64 encoded file
-        // 4 base64 characters = 3 output bytes (when decoded)
-        timestamp_base64_pos = line + 4;
+    fd = is_stdin ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &stbuf) == -1) {
+        fprintf(stderr, "Can't open manifest %s\n", name);
+        if (fd != -1 && !is_stdin)
+            close(fd);
+        return 1;
+    }
 
-        // We only decode the next 6 + 2 (for "==" padding) base64 characters (4 output bytes when decoded)
-        // We need the "==" padding after this base64 string for strict compliance to the base64 standard
-        //   - Base64 output bytes must be a multiple of 3 otherwise padding is required (we have 4 output bytes which is why we need two "=" pads)
-        //   - https://stackoverflow.com/a/36571117
-        // Some base64 decoders may be permissive here (e.g. the "base64" CLI with a warning) but the glib decoder is not
-        // This is faster because we only decode the necessary base64 to get our timestamp
-        timestamp_base64_pos[6] = '=';
-        timestamp_base64_pos[7] = '=';
-        timestamp_base64_pos[8] = '\0';
+    if (!S_ISREG(stbuf.st_mode)) {
+        int ret = merge_read(mapping, fd);
 
-        // Use "step" function to avoid malloc in non-step variant (we do our own memory allocation)
-        // Passed in base64 string *must* be zero-terminated
-        // Returns output length but we ignore it because we know that it's always going to be 4 for our input
-        g_base64_decode_step(timestamp_base64_pos, strlen(timestamp_base64_pos), (unsigned char*)out_timestamp, &state, &save);
+        if (!is_stdin)
+            close(fd);
+        // Freed along with the mappings even if the read failed
+        state->mappings_count++;
+        if (ret != 0) {
+            fprintf(stderr, "Failed to read manifest %s\n", name);
+            return 1;
+        }
+    }
+    else if (stbuf.st_size == 0) {
+        if (!is_stdin)
+            close(fd);
+        mapping->map = NULL;
+        mapping->size = 0;
+        mapping->read = 1;
+        state->mappings_count++;
+    }
+    else {
+        mapping->size = stbuf.st_size;
+        mapping->read = 0;
+        mapping->map = mmap(NULL, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (!is_stdin)
+            close(fd);
+        if (mapping->map == MAP_FAILED) {
+            fprintf(stderr, "Can't map manifest %s\n", name);
+            return 1;
+        }
+        state->mappings_count++;
+        madvise(mapping->map, mapping->size, MADV_SEQUENTIAL);
+    }
 
+    // An empty manifest is a text one without any keys (a binary one always has its header)
+    if (mapping->size == 0) {
+        state->shards_unknown = 1;
         return 0;
     }
 
-    return 1;
+    if (mapping->size >= sizeof(struct scan_manifest_header) && memcmp(mapping->map, SCAN_MANIFEST_MAGIC, 8) == 0)
+        return merge_load_binary(state, name, mapping->map, mapping->size);
+    state->shards_unknown = 1;
+    return merge_load_text(state, name, mapping->map, mapping->size);
+}
+
+int merge_key_compare(const void* a, const void* b)
+{
+    const struct merge_key* x = a;
+    const struct merge_key* y = b;
+    int ret;
+
+    if (x->timestamp != y->timestamp)
+        return (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+    ret = memcmp(x->path, y->path, x->path_len < y->path_len ? x->path_len : y->path_len);
+    if (ret != 0)
+        return ret;
+    return (x->path_len > y->path_len) - (x->path_len < y->path_len);
 }
 
-int pgp_key_extract_timestamp(char* file_path, unsigned int* out_timestamp) {
-    FILE* file;
-    char key_armor_check_buf[5];
+// Written out before another key could overflow the buffer, so a full disk or a closed pipe is noticed
+int merge_output(struct merge_state* state, const struct merge_key* key)
+{
+    if (SCAN_OUTPUT_BUFFER_SIZE - state->out.len < key->path_len + sizeof(struct scan_output_record) + 16) {
+        if (scan_index_write_all(state->out.fd, state->out.data, state->out.len) != 0)
+            return 1;
+        state->out.len = 0;
+    }
+
+    if (state->binary) {
+        struct scan_output_record record;
 
-    file = fopen(file_path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open PGP key: %s\n", file_path);
-        return 1;
+        record.timestamp = htonl(key->timestamp);
+        record.name_len = htons(key->path_len);
+        record.status = PGP_KEY_OK;
+        record.move = 0;
+        scan_output_write(&state->out, &record, sizeof(record));
+        scan_output_write(&state->out, key->path, key->path_len);
+    }
+    else {
+        scan_output_write(&state->out, key->path, key->path_len);
+        scan_output_write(&state->out, "\t", 1);
+        scan_output_uint(&state->out, key->timestamp);
+        scan_output_write(&state->out, "\n", 1);
+    }
+    return 0;
+}
+
+// complete: the manifests were the whole tree (the output is then marked shard 0 of 1)
+int merge_run(struct merge_state* state, int complete, int quiet)
+{
+    size_t written = 0;
+    size_t i;
+
+    qsort(state->keys, state->count, sizeof(*state->keys), merge_key_compare);
+
+    if (state->binary) {
+        struct scan_manifest_header header;
+
+        memcpy(header.magic, SCAN_MANIFEST_MAGIC, sizeof(header.magic));
+        header.shard_index = htonl(0);
+        header.shard_count = htonl(complete ? 1 : 0);
+        scan_output_write(&state->out, &header, sizeof(header));
+    }
+
+    for (i = 0; i < state->count; i++) {
+        // The same key in two manifests (e.g. a shard that was scanned twice)
+        if (i > 0 && merge_key_compare(&state->keys[i], &state->keys[i - 1]) == 0)
+            continue;
+        if (merge_output(state, &state->keys[i]) != 0)
+            break;
+        written++;
     }
 
-    // Search for start of:
-    // -----BEGIN PGP PRIVATE/PUBLIC KEY BLOCK-----
-    // If we find it then we must first dearmor the key
-    if (fread(key_armor_check_buf, 1, sizeof(key_armor_check_buf), file) < sizeof(key_armor_check_buf)) {
-        fprintf(stderr, "Failed to read PGP key: %s\n", file_path);
-        fclose(file);
+    if (i < state->count || scan_index_write_all(state->out.fd, state->out.data, state->out.len) != 0) {
+        fprintf(stderr, "Failed to write to stdout\n");
         return 1;
     }
 
-    if (memcmp(key_armor_check_buf, "-----", sizeof(key_armor_check_buf)) != 0) {
-        if (pgp_key_raw_extract_timestamp(file, out_timestamp) != 0) {
-            fprintf(stderr, "Failed to extract timestamp from raw PGP key: %s\n", file_path);
-            fclose(file);
+    if (!quiet)
+        fprintf(stderr, "Read %zu keys from %d manifests, %zu written\n", state->read, state->mappings_count, written);
+    return 0;
+}
+
+// Warns about the shards that are missing or there more than once when every manifest says which shard it is
+// Returns 1 if the manifests are exactly the whole tree
+int merge_check_shards(const struct merge_state* state)
+{
+    int complete = 1;
+    unsigned int i;
+
+    if (state->shards_unknown || state->shard_count == 0)
+        return 0;
+    if (state->shard_counts_differ) {
+        fprintf(stderr, "Warning: manifests are of different numbers of shards\n");
+        return 0;
+    }
+    for (i = 0; i < state->shard_count; i++) {
+        if (state->shards_seen[i] == 0)
+            fprintf(stderr, "Warning: no manifest for shard %u/%u\n", i, state->shard_count);
+        else if (state->shards_seen[i] > 1)
+            fprintf(stderr, "Warning: %u manifests for shard %u/%u\n", state->shards_seen[i], i, state->shard_count);
+        if (state->shards_seen[i] != 1)
+            complete = 0;
+    }
+    return complete;
+}
+
+void print_merge_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s merge [OPTIONS] <MANIFEST>...\n\n"
+
+                    "Combines the manifests of scans with --manifest (with --manifest-timestamps or --manifest-binary),\n"
+                    "e.g. one for each --shard, and prints every key listed in them, sorted by timestamp, with its\n"
+                    "timestamp. A scan without a primary key, --min or --max lists every key so the query can be\n"
+                    "applied here instead.\n\n"
+
+                    "Options:\n"
+                    "  -q, --quiet      Only report errors\n"
+                    "      --primary=KEY\n"
+                    "                   Only keys compatible with this primary PGP key (or timestamp), can be\n"
+                    "                   repeated to keep keys compatible with any of them\n"
+                    "      --min=KEY    Only keys created at or after KEY's timestamp (or a timestamp)\n"
+                    "      --max=KEY    Only keys created at or before KEY's timestamp (or a timestamp)\n"
+                    "      --output=FORMAT\n"
+                    "                   tsv (path and timestamp, default) or binary (as --manifest-binary)\n", progname);
+}
+
+enum {
+    OPT_MERGE_PRIMARY = 256,
+    OPT_MERGE_MIN,
+    OPT_MERGE_MAX,
+    OPT_MERGE_OUTPUT
+};
+
+int merge_main(const char* progname, int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "quiet", no_argument, NULL, 'q' },
+        { "primary", required_argument, NULL, OPT_MERGE_PRIMARY },
+        { "min", required_argument, NULL, OPT_MERGE_MIN },
+        { "max", required_argument, NULL, OPT_MERGE_MAX },
+        { "output", required_argument, NULL, OPT_MERGE_OUTPUT },
+        { NULL, 0, NULL, 0 }
+    };
+    struct merge_state state = { 0 };
+    struct scan_filter filter = { 0 };
+    struct scan_route* route;
+    const char* min_arg = NULL;
+    const char* max_arg = NULL;
+    int quiet = 0;
+    int opt;
+    int ret = 0;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, "q", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = 1;
+            break;
+        case OPT_MERGE_PRIMARY:
+            if (filter.count == SCAN_FILTER_MAX_ROUTES) {
+                fprintf(stderr, "Too many primary keys (at most %d)\n", SCAN_FILTER_MAX_ROUTES);
+                return 1;
+            }
+            route = &filter.routes[filter.count];
+            route->key = optarg;
+            route->dest_dir = NULL;
+            route->dest_fd = -1;
+            route->order = filter.count++;
+            break;
+        case OPT_MERGE_MIN:
+            min_arg = optarg;
+            break;
+        case OPT_MERGE_MAX:
+            max_arg = optarg;
+            break;
+        case OPT_MERGE_OUTPUT:
+            if (strcmp(optarg, "tsv") == 0)
+                state.binary = 0;
+            else if (strcmp(optarg, "binary") == 0)
+                state.binary = 1;
+            else {
+                fprintf(stderr, "Invalid output format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            print_merge_usage(progname);
             return 1;
         }
     }
-    else {
-        if (pgp_key_dearmor_extract_timestamp(file, out_timestamp) != 0) {
-            fprintf(stderr, "Failed to dearmor and extract timestamp from PGP key: %s\n", file_path);
-            fclose(file);
+
+    if (argc - optind < 1) {
+        print_merge_usage(progname);
+        return 1;
+    }
+
+    if (filter.count > 0 || min_arg != NULL || max_arg != NULL) {
+        if (scan_filter_compile(&filter, min_arg, max_arg) != 0)
             return 1;
-        }
+        state.filter = &filter;
+    }
+
+    state.out.fd = STDOUT_FILENO;
+    state.out.data = malloc(SCAN_OUTPUT_BUFFER_SIZE);
+    state.mappings = calloc(argc - optind, sizeof(*state.mappings));
+    if (state.out.data == NULL || state.mappings == NULL) {
+        fprintf(stderr, "Failed to allocate file buffers\n");
+        ret = 1;
+    }
+
+    for (i = optind; i < argc && ret == 0; i++)
+        ret = merge_load(&state, argv[i]);
+
+    if (ret == 0)
+        ret = merge_run(&state, merge_check_shards(&state), quiet);
+
+    for (i = 0; i < state.mappings_count; i++) {
+        if (state.mappings[i].read)
+            free(state.mappings[i].map);
+        else
+            munmap(state.mappings[i].map, state.mappings[i].size);
+    }
+    free(state.mappings);
+    free(state.shards_seen);
+    free(state.keys);
+    free(state.out.data);
+    return ret;
+}
+
+// Everything main opens for the scan apart from the source directory
+void scan_config_close(struct scan_config* config)
+{
+    size_t i;
+
+    for (i = 0; i < config->filter.count; i++) {
+        if (config->filter.routes[i].dest_fd != -1)
+            close(config->filter.routes[i].dest_fd);
+    }
+    if (config->manifest_fd != -1)
+        close(config->manifest_fd);
+    free(config->source_realpath);
+}
+
+void print_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] <SOURCE_DIRECTORY> [<PRIMARY_PGP_KEY> [<DESTINATION_DIRECTORY>]]\n"
+                    "       %s query [OPTIONS] <SOURCE_DIRECTORY> <PRIMARY_PGP_KEY|TIMESTAMP>...\n"
+                    "       %s filter [OPTIONS] <PRIMARY_PGP_KEY|TIMESTAMP> [<DESTINATION_DIRECTORY>]\n"
+                    "       %s merge [OPTIONS] <MANIFEST>...\n\n"
+
+                    "Passing a source directory with no other arguments opens each PGP key and prints its creation\n"
+                    "timestamp. Further specifying a primary PGP key and destination directory will move each PGP key if\n"
+                    "its creation timestamp is equal to or greater than that of the primary PGP key. Without a\n"
+                    "destination directory compatible keys are only reported.\n\n"
+
+                    "Both raw and ASCII-armored PGP keys are supported.\n\n"
+
+                    "Options:\n"
+                    "  -j, --jobs=N     Process keys with N worker threads (0 = one per CPU, auto = tune N (and the\n"
+                    "                   --prefetch depth) while scanning, default: 1)\n"
+                    "  -u, --unordered  Print results as soon as they're ready instead of in directory order\n"
+                    "  -r, --recursive  Also process keys in subdirectories (moved keys keep the same layout under\n"
+                    "                   the destination directory)\n"
+                    "  -q, --quiet      Only report errors\n"
+                    "      --progress   Print the number of files processed (and the rate) every second\n"
+                    "      --output=FORMAT\n"
+                    "                   How keys are reported: text (default), tsv (path and timestamp) or binary\n"
+                    "      --io=MODE    How key files are read: auto (default), uring or sync\n"
+                    "                   auto uses io_uring when the kernel supports it\n"
+                    "      --format=TOOL\n"
+                    "                   Which tool generated the keys: auto (default), vanitygpg, gnupg or sequoia\n"
+                    "                   Armored keys with its usual headers are parsed at fixed offsets\n"
+                    "      --prefetch[=N]\n"
+                    "                   Warm the page cache for the next N (default: %d) keys while the current ones\n"
+                    "                   are processed, for cold caches and slow disks (sync I/O only, does\n"
+                    "                   nothing without posix_fadvise, e.g. on macOS)\n"
+                    "      --inode-order\n"
+                    "                   Process keys in inode order (roughly on-disk order) instead of directory\n"
+                    "                   order within each bulk directory read (Linux only)\n"
+                    "      --files-from=FILE\n"
+                    "                   Read the paths of the keys (relative to the source directory) from FILE\n"
+                    "                   instead of reading the directory, - for stdin (NUL or newline delimited)\n"
+                    "      --watch      Keep running and process each key as soon as it's written to the source\n"
+                    "                   directory until interrupted (Linux only)\n"
+                    "      --index[=FILE]\n"
+                    "                   Answer unchanged keys from a timestamp index saved by previous runs and\n"
+                    "                   only read new or changed ones (default: " SCAN_INDEX_NAME " in the source\n"
+                    "                   directory)\n"
+                    "      --link       Hard link compatible keys into the destination directory instead of moving\n"
+                    "      --symlink    Symlink compatible keys into the destination directory instead of moving\n"
+                    "      --dry-run    Only report compatible keys, don't touch the destination directory\n",
+                    progname, progname, progname, progname, SCAN_PREFETCH_DEPTH);
+    fprintf(stderr, "      --manifest=FILE\n"
+                    "                   Write the path of every compatible key (relative to the source directory)\n"
+                    "                   to FILE, one per line (every key without a primary key, --min or --max)\n"
+                    "      --manifest-timestamps\n"
+                    "                   Follow each path in the manifest with a tab and its timestamp\n"
+                    "      --manifest-binary\n"
+                    "                   Write the manifest as binary records (timestamp and path, see README)\n"
+                    "      --shard=I/N  Only process the keys whose path hashes to shard I of N (0 <= I < N), so N\n"
+                    "                   processes or hosts can split one source directory between them\n"
+                    "      --primary=KEY[:DIR]\n"
+                    "                   Another primary PGP key (or timestamp) and where its compatible keys go\n"
+                    "                   (can be repeated, a key goes to the latest primary key it's compatible with)\n"
+                    "      --min=KEY    Only keys created at or after KEY's timestamp (or a timestamp)\n"
+                    "      --max=KEY    Only keys created at or before KEY's timestamp (or a timestamp)\n"
+                    "      --first=K    Stop as soon as K compatible keys have been found\n"
+                    "      --closest[=K]\n"
+                    "                   Only act on the K (default: 1) compatible keys closest in time to their\n"
+                    "                   primary key once the whole source directory has been scanned\n"
+                    "      --pack       The source is a keypack or tar archive of keys (- for stdin) instead of a\n"
+                    "                   directory, compatible keys are extracted into the destination directory\n"
+                    "      --pack-output\n"
+                    "                   With --pack, write compatible keys to a keypack at each destination instead\n"
+                    "      --checkpoint=FILE\n"
+                    "                   Record how far the scan has got in FILE every so often, so it can be resumed\n"
+                    "                   if it's interrupted (removed once the scan is done, Linux only)\n"
+                    "      --checkpoint-interval=N\n"
+                    "                   Write a checkpoint every N (default: %d) files\n"
+                    "      --resume     Carry on from the checkpoint in the --checkpoint file if there is one\n"
+                    "      --max-mem=SIZE\n"
+                    "                   Keep the memory the scan allocates under SIZE (K, M or G suffix) by shrinking\n"
+                    "                   its buffers, and print the peak at the end (also printed with --progress)\n",
+                    SCAN_CHECKPOINT_INTERVAL);
+}
+
+enum {
+    OPT_IO = 256,
+    OPT_INODE_ORDER,
+    OPT_INDEX,
+    OPT_FILES_FROM,
+    OPT_WATCH,
+    OPT_PROGRESS,
+    OPT_OUTPUT,
+    OPT_LINK,
+    OPT_SYMLINK,
+    OPT_DRY_RUN,
+    OPT_MANIFEST,
+    OPT_MANIFEST_TIMESTAMPS,
+    OPT_MIN,
+    OPT_MAX,
+    OPT_PRIMARY,
+    OPT_FIRST,
+    OPT_CLOSEST,
+    OPT_PACK,
+    OPT_PACK_OUTPUT,
+    OPT_PREFETCH,
+    OPT_FORMAT,
+    OPT_MANIFEST_BINARY,
+    OPT_SHARD,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_RESUME,
+    OPT_MAX_MEM
+};
+
+// I/N for --shard
+int shard_parse(const char* arg, unsigned int* out_index, unsigned int* out_count)
+{
+    size_t index_len = strspn(arg, "0123456789");
+    const char* count_arg = arg + index_len + 1;
+    unsigned long index;
+    unsigned long count;
+
+    errno = 0;
+    if (index_len == 0 || arg[index_len] != '/' || count_arg[0] == '\0' ||
+        strspn(count_arg, "0123456789") != strlen(count_arg) ||
+        (index = strtoul(arg, NULL, 10), count = strtoul(count_arg, NULL, 10), errno != 0) ||
+        count == 0 || count > SCAN_SHARD_MAX || index >= count) {
+        fprintf(stderr, "Invalid shard (expected I/N with 0 <= I < N <= %d): %s\n", SCAN_SHARD_MAX, arg);
+        return 1;
     }
 
-    // File format is in Network Byte Order (big endian) so convert it to our CPU endianness if necessary
-    *out_timestamp = ntohl(*out_timestamp);
+    *out_index = index;
+    *out_count = count;
+    return 0;
+}
+
+// K for --first and --closest
+int select_limit_parse(const char* arg, size_t* out_limit)
+{
+    char* end;
+    unsigned long limit;
 
-    fclose(file);
+    errno = 0;
+    limit = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || end == arg || limit == 0 || limit > 1000000) {
+        fprintf(stderr, "Invalid number of keys: %s\n", arg);
+        return 1;
+    }
+    *out_limit = limit;
     return 0;
 }
 
 int main(int argc, char** argv)
 {
-    char* source_dir;
-    char* dest_dir = NULL;
-    unsigned int timestamp_query;
+    static const struct option long_options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "unordered", no_argument, NULL, 'u' },
+        { "recursive", no_argument, NULL, 'r' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "progress", no_argument, NULL, OPT_PROGRESS },
+        { "output", required_argument, NULL, OPT_OUTPUT },
+        { "io", required_argument, NULL, OPT_IO },
+        { "inode-order", no_argument, NULL, OPT_INODE_ORDER },
+        { "index", optional_argument, NULL, OPT_INDEX },
+        { "files-from", required_argument, NULL, OPT_FILES_FROM },
+        { "watch", no_argument, NULL, OPT_WATCH },
+        { "link", no_argument, NULL, OPT_LINK },
+        { "symlink", no_argument, NULL, OPT_SYMLINK },
+        { "dry-run", no_argument, NULL, OPT_DRY_RUN },
+        { "manifest", required_argument, NULL, OPT_MANIFEST },
+        { "manifest-timestamps", no_argument, NULL, OPT_MANIFEST_TIMESTAMPS },
+        { "min", required_argument, NULL, OPT_MIN },
+        { "max", required_argument, NULL, OPT_MAX },
+        { "primary", required_argument, NULL, OPT_PRIMARY },
+        { "first", required_argument, NULL, OPT_FIRST },
+        { "closest", optional_argument, NULL, OPT_CLOSEST },
+        { "pack", no_argument, NULL, OPT_PACK },
+        { "pack-output", no_argument, NULL, OPT_PACK_OUTPUT },
+        { "prefetch", optional_argument, NULL, OPT_PREFETCH },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "manifest-binary", no_argument, NULL, OPT_MANIFEST_BINARY },
+        { "shard", required_argument, NULL, OPT_SHARD },
+        { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+        { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+        { "resume", no_argument, NULL, OPT_RESUME },
+        { "max-mem", required_argument, NULL, OPT_MAX_MEM },
+        { NULL, 0, NULL, 0 }
+    };
+    struct scan_config config = { 0 };
+    struct scan_pool pool;
+    struct scan_index index;
+    struct scan_select selection = { 0 };
+    int selections = 0;
+    struct scan_pack pack;
+    struct stat stbuf;
+    int use_pack = 0;
+    int pack_fd = -1;
+    int pack_output = 0;
+    int use_index = 0;
+    const char* index_path = NULL;
+    const char* files_from_path = NULL;
+    int files_from_fd = -1;
+    const char* manifest_path = NULL;
+    uint64_t manifest_size = 0;
+    const char* max_mem_arg = NULL;
+    int scanned = 0;
+    struct scan_tune tune;
+    struct scan_checkpoint checkpoint = { 0 };
+    const char* checkpoint_path = NULL;
+    int resume = 0;
+    int checkpoint_interval = 0;
+    int dry_run = 0;
+    const char* min_arg = NULL;
+    const char* max_arg = NULL;
+    struct scan_route* route;
+    char* separator;
+    unsigned int dests = 0;
+    size_t i;
     char* primary_pgp_key_file_path;
-    char* dest_file_path = NULL;
-    size_t dest_file_path_len = 0;
-    DIR* dir;
-    struct dirent *dirent;
-    char* file_path;
-    size_t file_path_len;
-    // We pass this value by reference to pgp_key_extract_timestamp
-    // This is *much* faster than allocating new memory (malloc) on every loop
-    unsigned int timestamp;
+    unsigned char* primary_pgp_key_buf;
+    DIR* dir = NULL;
+    int opt;
+    int ret = 0;
 
-    if (argc != 2 && argc != 4) {
-        fprintf(stderr, "Usage: %s <SOURCE_DIRECTORY> [<PRIMARY_PGP_KEY> <DESTINATION_DIRECTORY>]\n\n"
+    config.jobs = 1;
+    config.ordered = 1;
+    config.io = SCAN_IO_AUTO;
+    config.dest_dirfd = -1;
+    config.action = SCAN_ACTION_MOVE;
+    config.manifest_fd = -1;
+    checkpoint.interval = SCAN_CHECKPOINT_INTERVAL;
+    selection.wake_fd = -1;
+    atomic_init(&selection.claimed, 0);
 
-                        "Passing a source directory with no other arguments opens each PGP key and prints its creation\n"
-                        "timestamp. Further specifying a primary PGP key and destination directory will move each PGP key if\n"
-                        "its creation timestamp is equal to or greater than that of the primary PGP key.\n\n"
+    if (argc > 1 && strcmp(argv[1], "query") == 0)
+        return query_main(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "filter") == 0)
+        return filter_main(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+        return merge_main(argv[0], argc - 1, argv + 1);
 
-                        "Both raw and ASCII-armored PGP keys are supported.\n", argv[0]);
-        return 1;
-    }
+    while ((opt = getopt_long(argc, argv, "j:urq", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j': {
+            char* end;
+            unsigned long jobs;
 
-    source_dir = argv[1];
+            if (strcmp(optarg, "auto") == 0) {
+                config.tune = &tune;
+                break;
+            }
+            config.tune = NULL;
+            errno = 0;
+            jobs = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || end == optarg || jobs > 1024) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return 1;
+            }
+            if (jobs == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                jobs = cpus > 0 ? (unsigned long)cpus : 1;
+            }
+            config.jobs = jobs;
+            break;
+        }
+        case 'u':
+            config.ordered = 0;
+            break;
+        case 'r':
+            config.recursive = 1;
+            break;
+        case 'q':
+            config.quiet = 1;
+            break;
+        case OPT_PROGRESS:
+            config.progress = 1;
+            break;
+        case OPT_OUTPUT:
+            if (strcmp(optarg, "text") == 0)
+                config.output_format = SCAN_OUTPUT_TEXT;
+            else if (strcmp(optarg, "tsv") == 0)
+                config.output_format = SCAN_OUTPUT_TSV;
+            else if (strcmp(optarg, "binary") == 0)
+                config.output_format = SCAN_OUTPUT_BINARY;
+            else {
+                fprintf(stderr, "Invalid output format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_IO:
+            if (strcmp(optarg, "auto") == 0)
+                config.io = SCAN_IO_AUTO;
+            else if (strcmp(optarg, "sync") == 0)
+                config.io = SCAN_IO_SYNC;
+            else if (strcmp(optarg, "uring") == 0)
+                config.io = SCAN_IO_URING;
+            else {
+                fprintf(stderr, "Invalid I/O mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_FORMAT:
+            if (key_format_parse(optarg) != 0)
+                return 1;
+            break;
+        case OPT_MANIFEST_BINARY:
+            config.manifest_binary = 1;
+            break;
+        case OPT_SHARD:
+            if (shard_parse(optarg, &config.shard_index, &config.shard_count) != 0)
+                return 1;
+            break;
+        case OPT_CHECKPOINT:
+#ifdef __linux__
+            checkpoint_path = optarg;
+            break;
+#else
+            fprintf(stderr, "--checkpoint is only supported on Linux\n");
+            return 1;
+#endif
+        case OPT_CHECKPOINT_INTERVAL: {
+            char* end;
+            unsigned long interval;
 
-    if (argc == 4) {
-        primary_pgp_key_file_path = argv[2];
-        if (pgp_key_extract_timestamp(primary_pgp_key_file_path, &timestamp_query) != 0) {
-                fprintf(stderr, "Failed to read from primary PGP key!\n");
+            errno = 0;
+            interval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || end == optarg || interval == 0 || interval > SCAN_CHECKPOINT_MAX_INTERVAL) {
+                fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                return 1;
+            }
+            checkpoint.interval = interval;
+            checkpoint_interval = 1;
+            break;
+        }
+        case OPT_RESUME:
+            resume = 1;
+            break;
+        case OPT_MAX_MEM:
+            if (scan_mem_parse(optarg, &scan_mem.budget) != 0)
+                return 1;
+            max_mem_arg = optarg;
+            break;
+        case OPT_INODE_ORDER:
+            config.inode_order = 1;
+            break;
+        case OPT_INDEX:
+            use_index = 1;
+            index_path = optarg;
+            break;
+        case OPT_FILES_FROM:
+            files_from_path = optarg;
+            break;
+        case OPT_WATCH:
+#ifdef __linux__
+            config.watch = 1;
+            break;
+#else
+            fprintf(stderr, "--watch is only supported on Linux\n");
+            return 1;
+#endif
+        case OPT_LINK:
+            config.action = SCAN_ACTION_LINK;
+            break;
+        case OPT_SYMLINK:
+            config.action = SCAN_ACTION_SYMLINK;
+            break;
+        case OPT_DRY_RUN:
+            dry_run = 1;
+            break;
+        case OPT_MANIFEST:
+            manifest_path = optarg;
+            break;
+        case OPT_MANIFEST_TIMESTAMPS:
+            config.manifest_timestamps = 1;
+            break;
+        case OPT_MIN:
+            min_arg = optarg;
+            break;
+        case OPT_MAX:
+            max_arg = optarg;
+            break;
+        case OPT_PRIMARY:
+            if (config.filter.count == SCAN_FILTER_MAX_ROUTES) {
+                fprintf(stderr, "Too many primary keys (at most %d)\n", SCAN_FILTER_MAX_ROUTES);
+                return 1;
+            }
+            route = &config.filter.routes[config.filter.count];
+            route->key = optarg;
+            route->dest_dir = NULL;
+            route->order = config.filter.count++;
+            // KEY:DIR
+            if ((separator = strchr(optarg, ':')) != NULL) {
+                *separator = '\0';
+                route->dest_dir = separator + 1;
+            }
+            break;
+        case OPT_FIRST:
+            if (select_limit_parse(optarg, &selection.limit) != 0)
                 return 1;
+            selection.closest = 0;
+            selections++;
+            break;
+        case OPT_CLOSEST:
+            selection.limit = 1;
+            if (optarg != NULL && select_limit_parse(optarg, &selection.limit) != 0)
+                return 1;
+            selection.closest = 1;
+            selections++;
+            break;
+        case OPT_PACK:
+            use_pack = 1;
+            break;
+        case OPT_PACK_OUTPUT:
+            pack_output = 1;
+            break;
+        case OPT_PREFETCH: {
+            char* end;
+            unsigned long depth = SCAN_PREFETCH_DEPTH;
+
+            if (optarg != NULL) {
+                errno = 0;
+                depth = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || end == optarg || depth == 0 || depth > SCAN_PREFETCH_MAX_DEPTH) {
+                    fprintf(stderr, "Invalid prefetch depth: %s\n", optarg);
+                    return 1;
+                }
+            }
+#ifdef POSIX_FADV_WILLNEED
+            config.prefetch = depth;
+#else
+            // Nothing to warm the cache with (e.g. macOS), so it's accepted and ignored
+            (void)depth;
+#endif
+            break;
         }
-        fprintf(stderr, "Primary PGP key timestamp: %u\n", timestamp_query);
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-        dest_dir = argv[3];
+    if (argc - optind < 1 || argc - optind > 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
 
-        dest_file_path_len = strlen(dest_dir) + NAME_MAX + 1;
-        dest_file_path = malloc(dest_file_path_len);
-        if (dest_file_path == NULL) {
-            fprintf(stderr, "Failed to allocate destination file path\n");
+    // The primary key on the command line goes last (with the baseline messages, see below)
+    if (argc - optind >= 2) {
+        if (config.filter.count == SCAN_FILTER_MAX_ROUTES) {
+            fprintf(stderr, "Too many primary keys (at most %d)\n", SCAN_FILTER_MAX_ROUTES);
             return 1;
         }
+        route = &config.filter.routes[config.filter.count];
+        route->key = NULL;
+        route->dest_dir = argc - optind == 3 ? argv[optind + 2] : NULL;
+        route->order = config.filter.count++;
+    }
+    for (i = 0; i < config.filter.count; i++) {
+        config.filter.routes[i].dest_fd = -1;
+        dests += config.filter.routes[i].dest_dir != NULL;
     }
+    config.match = config.filter.count > 0 || min_arg != NULL || max_arg != NULL;
 
-    if ((dir = opendir(source_dir)) == NULL) {
-        fprintf(stderr, "Can't open directory %s\n", source_dir);
+    if (dests == 0 && config.action != SCAN_ACTION_MOVE) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (pack_output && !use_pack) {
+        fprintf(stderr, "--pack-output can only be used with --pack\n");
+        return 1;
+    }
+    if (use_pack && (files_from_path != NULL || config.watch || config.recursive || use_index ||
+                     (selections > 0 && selection.closest) || config.action != SCAN_ACTION_MOVE)) {
+        fprintf(stderr, "--pack can't be used with --files-from, --watch, --recursive, --index, --closest, --link or --symlink\n");
         return 1;
     }
 
-    file_path_len = strlen(source_dir) + NAME_MAX + 1;
-    file_path = malloc(file_path_len);
-    if (file_path == NULL) {
-        fprintf(stderr, "Failed to allocate file path\n");
+    if (dests == 0 || dry_run)
+        config.action = SCAN_ACTION_NONE;
+    // Nothing is taken out of a pack so compatible keys are copied out of it
+    else if (use_pack)
+        config.action = SCAN_ACTION_EXTRACT;
+
+    // Each directory's keys are moved into the same directory under the one destination
+    if (config.recursive && dests > 0 && config.filter.count > 1) {
+        fprintf(stderr, "--recursive only supports a single primary key when there's a destination directory\n");
         return 1;
     }
 
-    while ((dirent = readdir(dir)) != NULL) {
-        struct stat stbuf;
-        snprintf(file_path, file_path_len, "%s/%s", source_dir, dirent->d_name);
-        if (stat(file_path, &stbuf) == -1) {
-            fprintf(stderr, "Unable to stat file: %s\n", file_path);
-            continue;
+    // The index would lose every key that isn't in the list (and only knows about the source directory itself)
+    if (use_index && (files_from_path != NULL || config.watch || config.recursive)) {
+        fprintf(stderr, "--index can't be used with --files-from, --watch or --recursive\n");
+        return 1;
+    }
+    // Every shard would save the index of its own keys over the others'
+    if (use_index && index_path == NULL && config.shard_count > 0) {
+        fprintf(stderr, "--shard needs an index file of its own (--index=FILE)\n");
+        return 1;
+    }
+    if (config.manifest_binary && manifest_path == NULL) {
+        fprintf(stderr, "--manifest-binary needs --manifest\n");
+        return 1;
+    }
+    if ((files_from_path != NULL) + config.watch + config.recursive > 1) {
+        fprintf(stderr, "Only one of --files-from, --watch and --recursive can be used\n");
+        return 1;
+    }
+
+    if ((resume || checkpoint_interval) && checkpoint_path == NULL) {
+        fprintf(stderr, "--resume and --checkpoint-interval need --checkpoint=FILE\n");
+        return 1;
+    }
+    // The position is a directory offset, and everything before it has to be done and written out in order
+    if (checkpoint_path != NULL && (files_from_path != NULL || config.watch || use_pack || selections > 0 ||
+                                    config.inode_order || !config.ordered)) {
+        fprintf(stderr, "--checkpoint can't be used with --files-from, --watch, --pack, --first, --closest, --inode-order or -u\n");
+        return 1;
+    }
+
+    // Keys trickle in as fast as they're generated, which says nothing about the settings
+    if (config.tune != NULL && config.watch) {
+        fprintf(stderr, "-j auto can't be used with --watch\n");
+        return 1;
+    }
+
+    // Keys that are just being written (or are in a pack) are already in memory
+    if (config.prefetch > 0 && (config.watch || use_pack)) {
+        fprintf(stderr, "--prefetch can't be used with --watch or --pack\n");
+        return 1;
+    }
+
+    if (selections > 0) {
+        if (selections > 1) {
+            fprintf(stderr, "Only one of --first and --closest can be used\n");
+            return 1;
+        }
+        if (!config.match) {
+            fprintf(stderr, "--first and --closest need a primary key (or --min/--max)\n");
+            return 1;
+        }
+        // Stopping early would leave every key that wasn't reached out of the index
+        if (!selection.closest && use_index) {
+            fprintf(stderr, "--first can't be used with --index\n");
+            return 1;
+        }
+        if (selection.closest && config.watch) {
+            fprintf(stderr, "--closest can't be used with --watch as it waits for the scan to finish\n");
+            return 1;
         }
+        config.select = &selection;
+    }
 
-        // Skip directories
-        if ((stbuf.st_mode & S_IFMT) == S_IFDIR)
-            continue;
+#ifdef HAVE_IO_URING
+    // The prefetcher feeds the sync path, io_uring has the whole batch in flight anyway
+    if (config.prefetch > 0 && config.io == SCAN_IO_URING) {
+        fprintf(stderr, "--prefetch can't be used with --io=uring\n");
+        return 1;
+    }
+    if (config.prefetch > 0)
+        config.io = SCAN_IO_SYNC;
+    if (config.io != SCAN_IO_SYNC) {
+        if (scan_uring_available())
+            config.io = SCAN_IO_URING;
+        else if (config.io == SCAN_IO_URING) {
+            fprintf(stderr, "io_uring isn't available on this system\n");
+            return 1;
+        }
+        else
+            config.io = SCAN_IO_SYNC;
+    }
+#else
+    if (config.io == SCAN_IO_URING) {
+        fprintf(stderr, "io_uring support isn't compiled in\n");
+        return 1;
+    }
+    config.io = SCAN_IO_SYNC;
+#endif
+    // Keys in a pack are already in memory
+    if (use_pack)
+        config.io = SCAN_IO_SYNC;
+    config.batch_size = config.io == SCAN_IO_URING ? SCAN_URING_BATCH_SIZE : SCAN_BATCH_SIZE;
+    config.dir_buffer_size = SCAN_GETDENTS_BUFFER_SIZE;
+    // Small batches so --first doesn't read far past the last key it wants
+    if (config.select != NULL && !selection.closest)
+        config.batch_size = SCAN_BATCH_SIZE;
 
-        // Skip empty files
-        // This can happen if VanityGPG exits abruptly before writing key contents to a created file
-        if (stbuf.st_size == 0)
-            continue;
+    config.source_dir = argv[optind];
 
-        // Skip hidden files
-        if (dirent->d_name[0] == '.')
-            continue;
+    if (argc - optind >= 2) {
+        route = &config.filter.routes[config.filter.count - 1];
+        primary_pgp_key_file_path = argv[optind + 1];
+        primary_pgp_key_buf = malloc(PGP_KEY_HEADER_MAX_SIZE);
+        if (primary_pgp_key_buf == NULL) {
+            fprintf(stderr, "Failed to allocate file buffers\n");
+            return 1;
+        }
+        ret = pgp_key_extract_timestamp(AT_FDCWD, primary_pgp_key_file_path, primary_pgp_key_buf, &route->timestamp);
+        free(primary_pgp_key_buf);
+        if (ret != PGP_KEY_OK) {
+                fprintf(stderr, "%s: %s\n", pgp_key_strerror(ret), primary_pgp_key_file_path);
+                fprintf(stderr, "Failed to read from primary PGP key!\n");
+                return 1;
+        }
+        fprintf(stderr, "Primary PGP key timestamp: %u\n", route->timestamp);
+    }
+
+    if (config.match && scan_filter_compile(&config.filter, min_arg, max_arg) != 0)
+        return 1;
 
-        fprintf(stderr, "Opening: %s\n", file_path);
-        if (pgp_key_extract_timestamp(file_path, &timestamp) != 0)
+    if (config.action == SCAN_ACTION_SYMLINK && (config.source_realpath = realpath(config.source_dir, NULL)) == NULL) {
+        fprintf(stderr, "Can't resolve directory %s\n", config.source_dir);
+        return 1;
+    }
+
+    for (i = 0; i < config.filter.count && config.action != SCAN_ACTION_NONE; i++) {
+        route = &config.filter.routes[i];
+        if (route->dest_dir == NULL)
             continue;
-        printf("Timestamp: %u\n", timestamp);
+        if (pack_output) {
+            size_t j;
 
-        if (argc == 4) {
-            // Testing with GPG confirms that a subkey with the same timestamp as its primary key is also valid
-            if (timestamp >= timestamp_query) {
-                fprintf(stderr, "Moving compatible PGP subkey: %s\n", file_path);
-                snprintf(dest_file_path, dest_file_path_len, "%s/%s", dest_dir, dirent->d_name);
-                if (rename(file_path, dest_file_path) == -1) {
-                    fprintf(stderr, "Failed to move PGP key file: %s\n", file_path);
+            // Two writers would clobber each other's records
+            for (j = 0; j < i; j++) {
+                if (config.filter.routes[j].dest_dir != NULL && strcmp(config.filter.routes[j].dest_dir, route->dest_dir) == 0) {
+                    fprintf(stderr, "Each pack can only be written for one primary key: %s\n", route->dest_dir);
+                    scan_config_close(&config);
+                    return 1;
                 }
             }
+            if ((route->dest_fd = open(route->dest_dir, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+                fprintf(stderr, "Can't create pack %s\n", route->dest_dir);
+                scan_config_close(&config);
+                return 1;
+            }
+            continue;
+        }
+        if ((route->dest_fd = open(route->dest_dir, O_RDONLY | O_DIRECTORY)) == -1) {
+            fprintf(stderr, "Can't open directory %s\n", route->dest_dir);
+            scan_config_close(&config);
+            return 1;
+        }
+        // The destination of a recursive scan
+        config.dest_dir = (char*)route->dest_dir;
+        config.dest_dirfd = route->dest_fd;
+        if (fstat(config.dest_dirfd, &stbuf) == 0) {
+            config.dest_dev = stbuf.st_dev;
+            config.dest_ino = stbuf.st_ino;
         }
     }
 
-    free(file_path);
-    closedir(dir);
-    if (argc == 4)
-        free(dest_file_path);
+    // A resumed scan only knows what to keep of the manifest once it has read the checkpoint
+    if (manifest_path != NULL && (config.manifest_fd = open(manifest_path, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC) | O_CLOEXEC, 0644)) == -1) {
+        fprintf(stderr, "Can't create manifest %s\n", manifest_path);
+        scan_config_close(&config);
+        return 1;
+    }
+
+    if (use_pack) {
+        pack_fd = strcmp(config.source_dir, "-") == 0 ? STDIN_FILENO : open(config.source_dir, O_RDONLY | O_CLOEXEC);
+        if (pack_fd == -1) {
+            fprintf(stderr, "Can't open pack %s\n", config.source_dir);
+            scan_config_close(&config);
+            return 1;
+        }
+        if (scan_pack_open(&pack, pack_fd) != 0 || (pack_output && scan_pack_start_output(&pack, &config) != 0)) {
+            scan_pack_close(&pack);
+            if (pack_fd != STDIN_FILENO)
+                close(pack_fd);
+            scan_config_close(&config);
+            return 1;
+        }
+        config.pack = &pack;
+        config.source_dirfd = -1;
+
+        // A streamed record is only there until the next one is read
+        if (pack.map == NULL) {
+            config.jobs = 1;
+            config.batch_size = 1;
+            config.tune = NULL;
+        }
+    }
+    else {
+        if ((dir = opendir(config.source_dir)) == NULL) {
+            fprintf(stderr, "Can't open directory %s\n", config.source_dir);
+            scan_config_close(&config);
+            return 1;
+        }
+        config.source_dirfd = dirfd(dir);
+    }
+
+    if (files_from_path != NULL) {
+        if (strcmp(files_from_path, "-") == 0)
+            files_from_fd = STDIN_FILENO;
+        else if ((files_from_fd = open(files_from_path, O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "Can't open file list %s\n", files_from_path);
+            closedir(dir);
+            scan_config_close(&config);
+            return 1;
+        }
+    }
+
+    if (use_index) {
+        // A relative FILE is relative to the current directory like the other paths, the default lives in the source directory
+        if (index_path != NULL)
+            ret = scan_index_open(&index, AT_FDCWD, index_path);
+        else
+            ret = scan_index_open(&index, config.source_dirfd, SCAN_INDEX_NAME);
+        if (ret != 0) {
+            closedir(dir);
+            scan_config_close(&config);
+            return 1;
+        }
+        config.index = &index;
+    }
+
+    // After the index, which gets the records logged with the checkpoints
+    if (checkpoint_path != NULL) {
+        ret = scan_checkpoint_open(&checkpoint, &config, checkpoint_path, resume);
+        config.checkpoint = &checkpoint;
+    }
+    if (ret == 0 && resume && config.manifest_fd != -1)
+        ret = scan_checkpoint_manifest(&checkpoint, config.manifest_fd, manifest_path, &manifest_size);
+    if (ret == 0 && config.manifest_binary && manifest_size == 0) {
+        struct scan_manifest_header header;
+
+        memcpy(header.magic, SCAN_MANIFEST_MAGIC, sizeof(header.magic));
+        header.shard_index = htonl(config.shard_index);
+        header.shard_count = htonl(config.shard_count > 0 ? config.shard_count : 1);
+        if (scan_index_write_all(config.manifest_fd, &header, sizeof(header)) != 0) {
+            fprintf(stderr, "Failed to write manifest %s\n", manifest_path);
+            ret = 1;
+        }
+    }
+
+#ifdef __linux__
+    if (config.watch) {
+        sigset_t set;
+
+        scan_watch_signals(&set);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        if (config.select != NULL && (selection.wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+            fprintf(stderr, "Failed to set up watch\n");
+            ret = 1;
+        }
+    }
+#endif
+
+#ifdef SCAN_STATS
+    // Only for the scan itself once it's all set up, and before any of its threads start
+    if (ret == 0)
+        scan_stats_start();
+#endif
+
+    if (config.tune != NULL)
+        scan_tune_init(&tune, &config);
+    if (ret == 0 && max_mem_arg != NULL)
+        ret = scan_mem_plan(&config, max_mem_arg);
+    if (ret == 0)
+        ret = scan_pool_init(&pool, &config);
+    if (ret == 0) {
+        scanned = 1;
+        ret = scan_pool_run(&pool, dir, files_from_fd);
+        if (selection.closest)
+            ret |= scan_select_finish(&pool);
+        scan_pool_destroy(&pool);
+    }
+#ifdef __linux__
+    if (selection.wake_fd != -1)
+        close(selection.wake_fd);
+#endif
+
+    if (files_from_fd > STDIN_FILENO)
+        close(files_from_fd);
+
+    if (use_index) {
+        if (ret == 0)
+            ret = scan_index_write(&index);
+        scan_index_close(&index);
+    }
+
+    if (use_pack) {
+        ret |= scan_pack_finish_output(&pack, &config);
+        scan_pack_close(&pack);
+        if (pack_fd != STDIN_FILENO)
+            close(pack_fd);
+    }
+    else
+        closedir(dir);
+    if (config.manifest_fd != -1 && fsync(config.manifest_fd) == -1) {
+        fprintf(stderr, "Failed to write manifest %s\n", manifest_path);
+        ret = 1;
+    }
+    // Only once everything it would bring back is on disk
+    if (config.checkpoint != NULL)
+        ret |= scan_checkpoint_close(&checkpoint, ret == 0);
+    if (scanned && (config.progress || max_mem_arg != NULL) && !config.quiet)
+        scan_mem_report();
+    scan_config_close(&config);
+    return ret;
 }
@@ -0,0 +1,86 @@
+// Copyright (C) 2024 Elliot Killick <contact@elliotkillick.com>
+// Licensed under the MIT License. See LICENSE file for details.
+
+// libpgpts: OpenPGP key creation timestamp extraction
+//
+// The parser get-compatible-pgp-subkeys runs on every key, for programs that want to look at keys in memory (e.g. a
+// key generator throwing away incompatible keys before they're ever written to disk). A key is a buffer holding the
+// start of a raw or ASCII-armored v4 key, the first 512 bytes are enough unless the armor headers are unusually long
+// Nothing is allocated, no I/O is done and every function is safe to call from any number of threads at once
+// Build with make lib (libpgpts.a and libpgpts.so)
+
+#ifndef PGPTS_H
+#define PGPTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define PGP_TS_API __attribute__((visibility("default")))
+#else
+#define PGP_TS_API
+#endif
+
+// The values never change (get-compatible-pgp-subkeys writes them out in its binary output, where 1 means the key
+// file couldn't be opened)
+enum pgp_ts_status {
+    PGP_TS_OK = 0,
+    // len is 0
+    PGP_TS_ERR_EMPTY = 2,
+    // Too short to tell what it is (or, for pgp_ts_key_len, to tell where it ends)
+    PGP_TS_ERR_SHORT = 3,
+    // Raw key that ends before its timestamp
+    PGP_TS_ERR_RAW = 4,
+    // Armored key without a valid line of base64
+    PGP_TS_ERR_ARMOR = 5,
+    // Not an OpenPGP v4 key packet
+    PGP_TS_ERR_PACKET = 6
+};
+
+// Tools whose armor headers are always laid out the same way, so the timestamp of their keys is at a known offset
+enum pgp_ts_format {
+    // Any of them
+    PGP_TS_FORMAT_AUTO = 0,
+    PGP_TS_FORMAT_VANITYGPG,
+    PGP_TS_FORMAT_GNUPG,
+    PGP_TS_FORMAT_SEQUOIA
+};
+
+// Creation timestamp of the key in buf
+// Returns PGP_TS_OK and sets *out, or one of the other pgp_ts_status values (leaving *out alone)
+PGP_TS_API int pgp_ts_extract(const uint8_t* buf, size_t len, uint32_t* out);
+
+// pgp_ts_extract for keys expected to come from one tool (a pgp_ts_format): armored keys laid out the way it writes
+// them skip the search for the first line of base64. The result is the same for any key and any format, a key that
+// isn't in the format just takes the generic path (pgp_ts_extract is PGP_TS_FORMAT_AUTO)
+PGP_TS_API int pgp_ts_extract_format(const uint8_t* buf, size_t len, int format, uint32_t* out);
+
+// pgp_ts_extract for count keys at once: key i is lens[i] bytes at bufs[i]
+// out_timestamps[i] gets its timestamp (0 if it has none) and out_statuses[i] its status (out_statuses may be NULL)
+// Returns the number of keys that have a timestamp
+// The keys are independent, so a big batch can be split across threads by handing each a slice of the arrays
+PGP_TS_API size_t pgp_ts_extract_batch(const uint8_t* const* bufs, const size_t* lens, size_t count,
+                                       uint32_t* out_timestamps, int* out_statuses);
+
+// Length of the first key of a stream of concatenated raw or armored keys at buf (no leading whitespace)
+// An armored key runs to the end of its "-----END PGP" line and a raw key up to the next primary key packet, so the
+// end of a raw key is only known once the next one starts: final says there's nothing after buf + len
+// Returns PGP_TS_OK and sets *out_len, PGP_TS_ERR_SHORT if the key may go on past len (only when not final),
+// PGP_TS_ERR_RAW or PGP_TS_ERR_ARMOR if it's truncated or PGP_TS_ERR_PACKET if buf doesn't start with a key
+PGP_TS_API int pgp_ts_key_len(const uint8_t* buf, size_t len, int final, size_t* out_len);
+
+// The pgp_ts_format called name ("auto", "vanitygpg", "gnupg" or "sequoia"), or -1
+PGP_TS_API int pgp_ts_format_parse(const char* name);
+
+// Description of a pgp_ts_status value
+PGP_TS_API const char* pgp_ts_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif